@@ -6,16 +6,23 @@
 ///   1) This file contains different implementations of the ICP algorithm.
 ///   2) This code requires EIGEN and NANOFLANN.
 ///   3) If OPENMP is activated some part of the code will be parallelized.
-///   4) This code is for now designed for 3D registration
-///   5) Two main input types are Eigen::Matrix3Xd or Eigen::Map<Eigen::Matrix3Xd>
+///   4) This code is designed for 2D and 3D registration: the dimension is
+///      taken at compile time from the number of rows of the inputs
+///   5) Main input types are Eigen::Matrix2Xd, Eigen::Matrix3Xd or maps of them
 ///////////////////////////////////////////////////////////////////////////////
-///   namespace nanoflann: NANOFLANN KD-tree adaptor for EIGEN
+///   namespace nanoflann: NANOFLANN KD-tree adaptor and persistent index for EIGEN
 ///   namespace RigidMotionEstimator: functions to compute the rigid motion
 ///   namespace SICP: sparse ICP implementation
 ///   namespace ICP: reweighted ICP implementation
 ///////////////////////////////////////////////////////////////////////////////
 #ifndef ICP_H
 #define ICP_H
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cassert>
 #include <nanoflann.hpp>
 #include <Eigen/Dense>
 ///////////////////////////////////////////////////////////////////////////////
@@ -24,7 +31,7 @@ namespace nanoflann {
     /// This code is adapted from the KDTreeEigenMatrixAdaptor class of nanoflann.hpp
     template <class MatrixType, int DIM = -1, class Distance = nanoflann::metric_L2, typename IndexType = int>
     struct KDTreeAdaptor {
-        typedef KDTreeAdaptor<MatrixType,DIM,Distance> self_t;
+        typedef KDTreeAdaptor<MatrixType,DIM,Distance,IndexType> self_t;
         typedef typename MatrixType::Scalar              num_t;
         typedef typename Distance::template traits<num_t,self_t>::distance_t metric_t;
         typedef KDTreeSingleIndexAdaptor< metric_t,self_t,DIM,IndexType>  index_t;
@@ -37,16 +44,18 @@ namespace nanoflann {
         ~KDTreeAdaptor() {delete index;}
         const MatrixType &m_data_matrix;
         /// Query for the num_closest closest points to a given point (entered as query_point[0:dim-1]).
-        inline void query(const num_t *query_point, const size_t num_closest, IndexType *out_indices, num_t *out_distances_sq) const {
+        /// Exact by default; params.eps > 0 gives eps-approximate neighbours.
+        inline void query(const num_t *query_point, const size_t num_closest, IndexType *out_indices, num_t *out_distances_sq,
+                          const nanoflann::SearchParams& params = nanoflann::SearchParams()) const {
             nanoflann::KNNResultSet<typename MatrixType::Scalar,IndexType> resultSet(num_closest);
             resultSet.init(out_indices, out_distances_sq);
-            index->findNeighbors(resultSet, query_point, nanoflann::SearchParams());
+            index->findNeighbors(resultSet, query_point, params);
         }
         /// Query for the closest points to a given point (entered as query_point[0:dim-1]).
-        inline IndexType closest(const num_t *query_point) const {
+        inline IndexType closest(const num_t *query_point, const nanoflann::SearchParams& params = nanoflann::SearchParams()) const {
             IndexType out_indices;
             num_t out_distances_sq;
-            query(query_point, 1, &out_indices, &out_distances_sq);
+            query(query_point, 1, &out_indices, &out_distances_sq, params);
             return out_indices;
         }
         const self_t & derived() const {return *this;}
@@ -55,6 +64,7 @@ namespace nanoflann {
         /// Returns the distance between the vector "p1[0:size-1]" and the data point with index "idx_p2" stored in the class:
         inline num_t kdtree_distance(const num_t *p1, const size_t idx_p2,size_t size) const {
             num_t s=0;
+            if (DIM > 0) size = DIM; // fixed trip count
             for (size_t i=0; i<size; i++) {
                 const num_t d= p1[i]-m_data_matrix.coeff(i,idx_p2);
                 s+=d*d;
@@ -67,34 +77,145 @@ namespace nanoflann {
         }
         /// Optional bounding-box computation: return false to default to a standard bbox computation loop.
         template <class BBOX> bool kdtree_get_bbox(BBOX&) const {return false;}
+    private:
+        /// Owns its index: not copyable
+        KDTreeAdaptor(const KDTreeAdaptor&);
+        KDTreeAdaptor& operator=(const KDTreeAdaptor&);
+    };
+    /// KD-tree node visits of the closest point searches of a registration, approximate and exact ones apart
+    struct SearchStats {
+        SearchStats() : approximate_queries(0), approximate_visits(0), exact_queries(0), exact_visits(0),
+                        reference_queries(0), reference_saved(0) {}
+        size_t approximate_queries, approximate_visits;
+        size_t exact_queries, exact_visits;
+        /// Approximate searches repeated exactly, and the visits they saved over their exact repetition
+        size_t reference_queries;
+        double reference_saved;
+        /// Node visits saved by all the approximate searches, extrapolated from the repeated ones
+        double saved() const {
+            return reference_queries > 0 ? reference_saved*approximate_queries/reference_queries : 0.0;
+        }
+    };
+    /// Index of the closest point to every column of X, searched with epsilon `eps`.
+    /// With stats, the node visits are recorded, and one approximate search in search_reference_stride
+    /// is repeated exactly to measure what the approximation saves.
+    template <typename KDTree, typename Derived>
+    void closest_points(const KDTree& kdtree, const Eigen::MatrixBase<Derived>& X, float eps,
+                        SearchStats* stats, Eigen::VectorXi& ids) {
+        const bool reference = stats && eps > 0.0f;
+        size_t visits = 0, reference_queries = 0;
+        double reference_saved = 0.0;
+        ids.resize(X.cols());
+        #pragma omp parallel for reduction(+:visits,reference_queries,reference_saved)
+        for(int i=0; i<X.cols(); ++i) {
+            size_t v = 0;
+            ids(i) = kdtree.closest(X.col(i).data(), nanoflann::SearchParams(32, eps, true, stats ? &v : NULL));
+            visits += v;
+            if(reference && i % search_reference_stride == 0) {
+                size_t r = 0;
+                kdtree.closest(X.col(i).data(), nanoflann::SearchParams(32, 0.0f, true, &r));
+                reference_queries++;
+                reference_saved += double(r) - double(v);
+            }
+        }
+        if(!stats) return;
+        if(eps > 0.0f) {
+            stats->approximate_queries += X.cols();
+            stats->approximate_visits += visits;
+            stats->reference_queries += reference_queries;
+            stats->reference_saved += reference_saved;
+        } else {
+            stats->exact_queries += X.cols();
+            stats->exact_visits += visits;
+        }
+    }
+    /// Persistent KD-tree that owns its points (one per column), to be kept across registrations.
+    /// Points can be replaced or appended; the tree is then rebuilt, once, by an explicit build().
+    /// tree() never builds: after build(), it can be called and queried from several threads at once,
+    /// as long as the points are not changed meanwhile.
+    template <int DIM, typename Scalar = double, class Distance = nanoflann::metric_L2_Fixed<DIM>, typename IndexType = int>
+    class KDTreeIndex {
+    public:
+        typedef Eigen::Matrix<Scalar, DIM, Eigen::Dynamic> MatrixType;
+        typedef KDTreeAdaptor<MatrixType, DIM, Distance, IndexType> tree_t;
+        explicit KDTreeIndex(const int leaf_max_size = 10) : m_leaf_max_size(leaf_max_size), m_points(DIM, 0), m_dirty(true) {}
+        template <typename Derived>
+        explicit KDTreeIndex(const Eigen::MatrixBase<Derived>& points, const int leaf_max_size = 10) :
+            m_leaf_max_size(leaf_max_size), m_points(points), m_dirty(true) {}
+        /// Replace all the points
+        template <typename Derived>
+        void set(const Eigen::MatrixBase<Derived>& points) {
+            m_points = points;
+            m_dirty = true;
+        }
+        /// Append points after the existing ones: indices of the existing points are kept
+        template <typename Derived>
+        void append(const Eigen::MatrixBase<Derived>& points) {
+            const typename MatrixType::Index cols = m_points.cols();
+            m_points.conservativeResize(Eigen::NoChange, cols + points.cols());
+            m_points.rightCols(points.cols()) = points;
+            m_dirty = true;
+        }
+        void clear() {
+            m_points.resize(DIM, 0);
+            m_tree.reset();
+            m_dirty = true;
+        }
+        inline const MatrixType& points() const {return m_points;}
+        inline typename MatrixType::Index size() const {return m_points.cols();}
+        /// True if the points changed since the tree was last built
+        inline bool dirty() const {return m_dirty;}
+        /// Build the tree now if the points changed
+        void build() {
+            if(!m_dirty) return;
+            m_tree.reset(); // the old tree refers to the old storage
+            if(m_points.cols() > 0) m_tree.reset(new tree_t(m_points, m_leaf_max_size));
+            m_dirty = false;
+        }
+        /// The tree over the current points. build() must have been called since they last changed,
+        /// and the index must not be empty.
+        const tree_t& tree() const {
+            assert(!m_dirty && m_tree);
+            return *m_tree;
+        }
+    private:
+        int m_leaf_max_size;
+        MatrixType m_points;
+        std::unique_ptr<tree_t> m_tree;
+        bool m_dirty;
+        KDTreeIndex(const KDTreeIndex&);
+        KDTreeIndex& operator=(const KDTreeIndex&);
     };
 }
 ///////////////////////////////////////////////////////////////////////////////
 /// Compute the rigid motion for point-to-point and point-to-plane distances
 namespace RigidMotionEstimator {
-    /// @param Source (one 3D point per column)
-    /// @param Target (one 3D point per column)
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
     /// @param Confidence weights
     template <typename Derived1, typename Derived2, typename Derived3>
-    Eigen::Affine3d point_to_point(Eigen::MatrixBase<Derived1>& X,
+    Eigen::Transform<double, Derived1::RowsAtCompileTime, Eigen::Affine> point_to_point(Eigen::MatrixBase<Derived1>& X,
                                    Eigen::MatrixBase<Derived2>& Y,
                                    const Eigen::MatrixBase<Derived3>& w) {
+        enum { Dim = Derived1::RowsAtCompileTime };
+        typedef Eigen::Matrix<double, Dim, 1> VectorD;
+        typedef Eigen::Matrix<double, Dim, Dim> MatrixDD;
         /// Normalize weight vector
         Eigen::VectorXd w_normalized = w/w.sum();
         /// De-mean
-        Eigen::Vector3d X_mean, Y_mean;
-        for(int i=0; i<3; ++i) {
+        VectorD X_mean, Y_mean;
+        for(int i=0; i<Dim; ++i) {
             X_mean(i) = (X.row(i).array()*w_normalized.transpose().array()).sum();
             Y_mean(i) = (Y.row(i).array()*w_normalized.transpose().array()).sum();
         }
         X.colwise() -= X_mean;
         Y.colwise() -= Y_mean;
         /// Compute transformation
-        Eigen::Affine3d transformation;
-        Eigen::Matrix3d sigma = X * w_normalized.asDiagonal() * Y.transpose();
-        Eigen::JacobiSVD<Eigen::Matrix3d> svd(sigma, Eigen::ComputeFullU | Eigen::ComputeFullV);
+        Eigen::Transform<double, Dim, Eigen::Affine> transformation;
+        MatrixDD sigma = X * w_normalized.asDiagonal() * Y.transpose();
+        Eigen::JacobiSVD<MatrixDD> svd(sigma, Eigen::ComputeFullU | Eigen::ComputeFullV);
         if(svd.matrixU().determinant()*svd.matrixV().determinant() < 0.0) {
-            Eigen::Vector3d S = Eigen::Vector3d::Ones(); S(2) = -1.0;
+            VectorD S = VectorD::Ones(); S(Dim-1) = -1.0;
             transformation.linear().noalias() = svd.matrixV()*S.asDiagonal()*svd.matrixU().transpose();
         } else {
             transformation.linear().noalias() = svd.matrixV()*svd.matrixU().transpose();
@@ -108,24 +229,24 @@ namespace RigidMotionEstimator {
         /// Return transformation
         return transformation;
     }
-    /// @param Source (one 3D point per column)
-    /// @param Target (one 3D point per column)
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
     template <typename Derived1, typename Derived2>
-    inline Eigen::Affine3d point_to_point(Eigen::MatrixBase<Derived1>& X,
+    inline Eigen::Transform<double, Derived1::RowsAtCompileTime, Eigen::Affine> point_to_point(Eigen::MatrixBase<Derived1>& X,
                                           Eigen::MatrixBase<Derived2>& Y) {
         return point_to_point(X, Y, Eigen::VectorXd::Ones(X.cols()));
     }
-    /// @param Source (one 3D point per column)
-    /// @param Target (one 3D point per column)
-    /// @param Target normals (one 3D normal per column)
-    /// @param Confidence weights
-    /// @param Right hand side
+    namespace internal {
+    /// Point-to-plane solvers, one per dimension
+    template <int Dim> struct PointToPlane;
+    /// 3D: 6x6 normal equations in (rotation vector, translation)
+    template <> struct PointToPlane<3> {
     template <typename Derived1, typename Derived2, typename Derived3, typename Derived4, typename Derived5>
-    Eigen::Affine3d point_to_plane(Eigen::MatrixBase<Derived1>& X,
-                                   Eigen::MatrixBase<Derived2>& Y,
-                                   Eigen::MatrixBase<Derived3>& N,
-                                   const Eigen::MatrixBase<Derived4>& w,
-                                   const Eigen::MatrixBase<Derived5>& u) {
+    static Eigen::Affine3d run(Eigen::MatrixBase<Derived1>& X,
+                               Eigen::MatrixBase<Derived2>& Y,
+                               Eigen::MatrixBase<Derived3>& N,
+                               const Eigen::MatrixBase<Derived4>& w,
+                               const Eigen::MatrixBase<Derived5>& u) {
         typedef Eigen::Matrix<double, 6, 6> Matrix66;
         typedef Eigen::Matrix<double, 6, 1> Vector6;
         typedef Eigen::Block<Matrix66, 3, 3> Block33;
@@ -183,12 +304,68 @@ namespace RigidMotionEstimator {
         /// Return transformation
         return transformation;
     }
-    /// @param Source (one 3D point per column)
-    /// @param Target (one 3D point per column)
-    /// @param Target normals (one 3D normal per column)
+    };
+    /// 2D: 3x3 normal equations in (rotation angle, translation)
+    template <> struct PointToPlane<2> {
+    template <typename Derived1, typename Derived2, typename Derived3, typename Derived4, typename Derived5>
+    static Eigen::Affine2d run(Eigen::MatrixBase<Derived1>& X,
+                               Eigen::MatrixBase<Derived2>& Y,
+                               Eigen::MatrixBase<Derived3>& N,
+                               const Eigen::MatrixBase<Derived4>& w,
+                               const Eigen::MatrixBase<Derived5>& u) {
+        /// Normalize weight vector
+        Eigen::VectorXd w_normalized = w/w.sum();
+        /// De-mean
+        Eigen::Vector2d X_mean;
+        for(int i=0; i<2; ++i)
+            X_mean(i) = (X.row(i).array()*w_normalized.transpose().array()).sum();
+        X.colwise() -= X_mean;
+        Y.colwise() -= X_mean;
+        /// Prepare LHS and RHS: the 2D cross product of a point and a normal is a scalar
+        Eigen::Matrix3d LHS = Eigen::Matrix3d::Zero();
+        Eigen::Vector3d RHS = Eigen::Vector3d::Zero();
+        for(int i=0; i<X.cols(); i++) {
+            const Eigen::Vector3d J(X(0,i)*N(1,i) - X(1,i)*N(0,i), N(0,i), N(1,i));
+            LHS.selfadjointView<Eigen::Upper>().rankUpdate(J, w(i));
+            double dist_to_plane = -((X.col(i) - Y.col(i)).dot(N.col(i)) - u(i))*w(i);
+            RHS += J*dist_to_plane;
+        }
+        LHS = LHS.selfadjointView<Eigen::Upper>();
+        /// Compute transformation
+        Eigen::Affine2d transformation;
+        Eigen::LDLT<Eigen::Matrix3d> ldlt(LHS);
+        RHS = ldlt.solve(RHS);
+        transformation = Eigen::Rotation2Dd(RHS(0));
+        transformation.translation() = RHS.tail<2>();
+        /// Apply transformation
+        X = transformation*X;
+        /// Re-apply mean
+        X.colwise() += X_mean;
+        Y.colwise() += X_mean;
+        /// Return transformation
+        return transformation;
+    }
+    };
+    }
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
+    /// @param Target normals (one 2D or 3D normal per column)
+    /// @param Confidence weights
+    /// @param Right hand side
+    template <typename Derived1, typename Derived2, typename Derived3, typename Derived4, typename Derived5>
+    inline Eigen::Transform<double, Derived1::RowsAtCompileTime, Eigen::Affine> point_to_plane(Eigen::MatrixBase<Derived1>& X,
+                                   Eigen::MatrixBase<Derived2>& Y,
+                                   Eigen::MatrixBase<Derived3>& N,
+                                   const Eigen::MatrixBase<Derived4>& w,
+                                   const Eigen::MatrixBase<Derived5>& u) {
+        return internal::PointToPlane<Derived1::RowsAtCompileTime>::run(X, Y, N, w, u);
+    }
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
+    /// @param Target normals (one 2D or 3D normal per column)
     /// @param Confidence weights
     template <typename Derived1, typename Derived2, typename Derived3, typename Derived4>
-    inline Eigen::Affine3d point_to_plane(Eigen::MatrixBase<Derived1>& X,
+    inline Eigen::Transform<double, Derived1::RowsAtCompileTime, Eigen::Affine> point_to_plane(Eigen::MatrixBase<Derived1>& X,
                                           Eigen::MatrixBase<Derived2>& Yp,
                                           Eigen::MatrixBase<Derived3>& Yn,
                                           const Eigen::MatrixBase<Derived4>& w) {
@@ -209,6 +386,9 @@ namespace SICP {
         int max_inner = 1;        /// max inner iteration. If max_inner=1 then ADMM else ALM
         double stop = 1e-5;       /// stopping criteria
         bool print_icpn = false;  /// (debug) print ICP iteration 
+        float eps = 0.0f;         /// approximate search epsilon of the first ICP iteration, halved at each one (0: exact)
+        int exact_icp = 2;        /// last ICP iterations, always searched exactly
+        nanoflann::SearchStats* stats = nullptr; /// (out) if set, accumulates the KD-tree node visits
     };
     /// Shrinkage operator (Automatic loop unrolling using template)
     template<unsigned int I>
@@ -217,9 +397,9 @@ namespace SICP {
     }
     template<>
     inline double shrinkage<0>(double, double, double, double s) {return s;}
-    /// 3D Shrinkage for point-to-point
-    template<unsigned int I>
-    inline void shrink(Eigen::Matrix3Xd& Q, double mu, double p) {
+    /// 2D/3D Shrinkage for point-to-point
+    template<unsigned int I, int Dim>
+    inline void shrink(Eigen::Matrix<double, Dim, Eigen::Dynamic>& Q, double mu, double p) {
         double Ba = std::pow((2.0/mu)*(1.0-p), 1.0/(2.0-p));
         double ha = Ba + (p/mu)*std::pow(Ba, p-1.0);
         #pragma omp parallel for
@@ -244,28 +424,34 @@ namespace SICP {
         }
     }
     /// Sparse ICP with point to point
-    /// @param Source (one 3D point per column)
-    /// @param Target (one 3D point per column)
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
+    /// @param KD-tree over the target, built once and reused (e.g. nanoflann::KDTreeIndex::tree())
     /// @param Parameters
-    template <typename Derived1, typename Derived2>
+    template <typename Derived1, typename Derived2, typename KDTree>
     void point_to_point(Eigen::MatrixBase<Derived1>& X,
                         Eigen::MatrixBase<Derived2>& Y,
-                        Parameters par = Parameters()) {
-        /// Build kd-tree
-        nanoflann::KDTreeAdaptor<Eigen::MatrixBase<Derived2>, 3, nanoflann::metric_L2_Simple> kdtree(Y);
+                        const KDTree& kdtree,
+                        Parameters par) {
+        enum { Dim = Derived1::RowsAtCompileTime };
+        typedef Eigen::Matrix<double, Dim, Eigen::Dynamic> MatrixDX;
         /// Buffers
-        Eigen::Matrix3Xd Q = Eigen::Matrix3Xd::Zero(3, X.cols());
-        Eigen::Matrix3Xd Z = Eigen::Matrix3Xd::Zero(3, X.cols());
-        Eigen::Matrix3Xd C = Eigen::Matrix3Xd::Zero(3, X.cols());
-        Eigen::Matrix3Xd Xo1 = X;
-        Eigen::Matrix3Xd Xo2 = X;
+        MatrixDX Q = MatrixDX::Zero(Dim, X.cols());
+        MatrixDX Z = MatrixDX::Zero(Dim, X.cols());
+        MatrixDX C = MatrixDX::Zero(Dim, X.cols());
+        MatrixDX Xo1 = X;
+        MatrixDX Xo2 = X;
+        Eigen::VectorXi ids;
+        bool exact = false;
         /// ICP
         for(int icp=0; icp<par.max_icp; ++icp) {
             if(par.print_icpn) std::cout << "Iteration #" << icp << "/" << par.max_icp << std::endl;
-            /// Find closest point
+            /// Find closest point, approximately in the first iterations
+            const float eps = exact ? 0.0f : nanoflann::scheduled_eps(par.eps, icp, par.max_icp, par.exact_icp);
+            nanoflann::closest_points(kdtree, X, eps, par.stats, ids);
             #pragma omp parallel for
             for(int i=0; i<X.cols(); ++i) {
-                Q.col(i) = Y.col(kdtree.closest(X.col(i).data()));
+                Q.col(i) = Y.col(ids(i));
             }
             /// Computer rotation and translation
             double mu = par.mu;
@@ -276,7 +462,7 @@ namespace SICP {
                     Z = X-Q+C/mu;
                     shrink<3>(Z, mu, par.p);
                     /// Rotation and translation update
-                    Eigen::Matrix3Xd U = Q+Z-C/mu;
+                    MatrixDX U = Q+Z-C/mu;
                     RigidMotionEstimator::point_to_point(X, U);
                     /// Stopping criteria
                     dual = (X-Xo1).colwise().norm().maxCoeff();
@@ -284,7 +470,7 @@ namespace SICP {
                     if(dual < par.stop) break;
                 }
                 /// C update (lagrange multipliers)
-                Eigen::Matrix3Xd P = X-Q-Z;
+                MatrixDX P = X-Q-Z;
                 if(!par.use_penalty) C.noalias() += mu*P;
                 /// mu update (penalty)
                 if(mu < par.max_mu) mu *= par.alpha;
@@ -295,38 +481,58 @@ namespace SICP {
             /// Stopping criteria
             double stop = (X-Xo2).colwise().norm().maxCoeff();
             Xo2 = X;
-            if(stop < par.stop) break;
+            if(stop < par.stop) {
+                if(eps == 0.0f) break;
+                exact = true; /// converged on approximate neighbours: confirm with exact ones
+            }
         }
     }
+    /// Sparse ICP with point to point
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
+    /// @param Parameters
+    template <typename Derived1, typename Derived2>
+    void point_to_point(Eigen::MatrixBase<Derived1>& X,
+                        Eigen::MatrixBase<Derived2>& Y,
+                        Parameters par = Parameters()) {
+        /// Build kd-tree
+        nanoflann::KDTreeAdaptor<Eigen::MatrixBase<Derived2>, Derived1::RowsAtCompileTime, nanoflann::metric_L2_Fixed<Derived1::RowsAtCompileTime> > kdtree(Y);
+        point_to_point(X, Y, kdtree, par);
+    }
     /// Sparse ICP with point to plane
-    /// @param Source (one 3D point per column)
-    /// @param Target (one 3D point per column)
-    /// @param Target normals (one 3D normal per column)
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
+    /// @param Target normals (one 2D or 3D normal per column)
+    /// @param KD-tree over the target, built once and reused (e.g. nanoflann::KDTreeIndex::tree())
     /// @param Parameters
-    template <typename Derived1, typename Derived2, typename Derived3>
+    template <typename Derived1, typename Derived2, typename Derived3, typename KDTree>
     void point_to_plane(Eigen::MatrixBase<Derived1>& X,
                         Eigen::MatrixBase<Derived2>& Y,
                         Eigen::MatrixBase<Derived3>& N,
-                        Parameters par = Parameters()) {
-        /// Build kd-tree
-        nanoflann::KDTreeAdaptor<Eigen::MatrixBase<Derived2>, 3, nanoflann::metric_L2_Simple> kdtree(Y);
+                        const KDTree& kdtree,
+                        Parameters par) {
+        enum { Dim = Derived1::RowsAtCompileTime };
+        typedef Eigen::Matrix<double, Dim, Eigen::Dynamic> MatrixDX;
         /// Buffers
-        Eigen::Matrix3Xd Qp = Eigen::Matrix3Xd::Zero(3, X.cols());
-        Eigen::Matrix3Xd Qn = Eigen::Matrix3Xd::Zero(3, X.cols());
+        MatrixDX Qp = MatrixDX::Zero(Dim, X.cols());
+        MatrixDX Qn = MatrixDX::Zero(Dim, X.cols());
         Eigen::VectorXd Z = Eigen::VectorXd::Zero(X.cols());
         Eigen::VectorXd C = Eigen::VectorXd::Zero(X.cols());
-        Eigen::Matrix3Xd Xo1 = X;
-        Eigen::Matrix3Xd Xo2 = X;
+        MatrixDX Xo1 = X;
+        MatrixDX Xo2 = X;
+        Eigen::VectorXi ids;
+        bool exact = false;
         /// ICP
         for(int icp=0; icp<par.max_icp; ++icp) {
             if(par.print_icpn) std::cout << "Iteration #" << icp << "/" << par.max_icp << std::endl;
             
-            /// Find closest point
+            /// Find closest point, approximately in the first iterations
+            const float eps = exact ? 0.0f : nanoflann::scheduled_eps(par.eps, icp, par.max_icp, par.exact_icp);
+            nanoflann::closest_points(kdtree, X, eps, par.stats, ids);
             #pragma omp parallel for
             for(int i=0; i<X.cols(); ++i) {
-                int id = kdtree.closest(X.col(i).data());
-                Qp.col(i) = Y.col(id);
-                Qn.col(i) = N.col(id);
+                Qp.col(i) = Y.col(ids(i));
+                Qn.col(i) = N.col(ids(i));
             }
             /// Computer rotation and translation
             double mu = par.mu;
@@ -345,7 +551,7 @@ namespace SICP {
                     if(dual < par.stop) break;
                 }
                 /// C update (lagrange multipliers)
-                Eigen::VectorXf P = (Qn.array()*(X-Qp).array()).colwise().sum().transpose()-Z.array();
+                Eigen::VectorXd P = (Qn.array()*(X-Qp).array()).colwise().sum().transpose()-Z.array();
                 if(!par.use_penalty) C.noalias() += mu*P;
                 /// mu update (penalty)
                 if(mu < par.max_mu) mu *= par.alpha;
@@ -356,9 +562,26 @@ namespace SICP {
             /// Stopping criteria
             double stop = (X-Xo2).colwise().norm().maxCoeff();
             Xo2 = X;
-            if(stop < par.stop) break;
+            if(stop < par.stop) {
+                if(eps == 0.0f) break;
+                exact = true; /// converged on approximate neighbours: confirm with exact ones
+            }
         }
     }
+    /// Sparse ICP with point to plane
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
+    /// @param Target normals (one 2D or 3D normal per column)
+    /// @param Parameters
+    template <typename Derived1, typename Derived2, typename Derived3>
+    void point_to_plane(Eigen::MatrixBase<Derived1>& X,
+                        Eigen::MatrixBase<Derived2>& Y,
+                        Eigen::MatrixBase<Derived3>& N,
+                        Parameters par = Parameters()) {
+        /// Build kd-tree
+        nanoflann::KDTreeAdaptor<Eigen::MatrixBase<Derived2>, Derived1::RowsAtCompileTime, nanoflann::metric_L2_Fixed<Derived1::RowsAtCompileTime> > kdtree(Y);
+        point_to_plane(X, Y, N, kdtree, par);
+    }
 }
 ///////////////////////////////////////////////////////////////////////////////
 /// ICP implementation using iterative reweighting
@@ -377,13 +600,19 @@ namespace ICP {
                        p(0.1),
                        max_icp(100),
                        max_outer(100),
-                       stop(1e-5) {}
+                       stop(1e-5),
+                       eps(0.0f),
+                       exact_icp(2),
+                       stats(nullptr) {}
         /// Parameters
         Function f;     /// robust function type
         double p;       /// paramter of the robust function
         int max_icp;    /// max ICP iteration
         int max_outer;  /// max outer iteration
         double stop;    /// stopping criteria
+        float eps;      /// approximate search epsilon of the first ICP iteration, halved at each one (0: exact)
+        int exact_icp;  /// last ICP iterations, always searched exactly
+        nanoflann::SearchStats* stats; /// (out) if set, accumulates the KD-tree node visits
     };
     /// Weight functions
     /// @param Residuals
@@ -455,25 +684,32 @@ namespace ICP {
         }
     }
     /// Reweighted ICP with point to point
-    /// @param Source (one 3D point per column)
-    /// @param Target (one 3D point per column)
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
+    /// @param KD-tree over the target, built once and reused (e.g. nanoflann::KDTreeIndex::tree())
     /// @param Parameters
-    void point_to_point(Eigen::Matrix3Xd& X,
-                        Eigen::Matrix3Xd& Y,
-                        Parameters par = Parameters()) {
-        /// Build kd-tree
-        nanoflann::KDTreeAdaptor<Eigen::Matrix3Xd, 3, nanoflann::metric_L2_Simple> kdtree(Y);
+    template <typename Derived1, typename Derived2, typename KDTree>
+    void point_to_point(Eigen::MatrixBase<Derived1>& X,
+                        Eigen::MatrixBase<Derived2>& Y,
+                        const KDTree& kdtree,
+                        Parameters par) {
+        enum { Dim = Derived1::RowsAtCompileTime };
+        typedef Eigen::Matrix<double, Dim, Eigen::Dynamic> MatrixDX;
         /// Buffers
-        Eigen::Matrix3Xd Q = Eigen::Matrix3Xd::Zero(3, X.cols());
+        MatrixDX Q = MatrixDX::Zero(Dim, X.cols());
         Eigen::VectorXd W = Eigen::VectorXd::Zero(X.cols());
-        Eigen::Matrix3Xd Xo1 = X;
-        Eigen::Matrix3Xd Xo2 = X;
+        MatrixDX Xo1 = X;
+        MatrixDX Xo2 = X;
+        Eigen::VectorXi ids;
+        bool exact = false;
         /// ICP
         for(int icp=0; icp<par.max_icp; ++icp) {
-            /// Find closest point
+            /// Find closest point, approximately in the first iterations
+            const float eps = exact ? 0.0f : nanoflann::scheduled_eps(par.eps, icp, par.max_icp, par.exact_icp);
+            nanoflann::closest_points(kdtree, X, eps, par.stats, ids);
             #pragma omp parallel for
             for(int i=0; i<X.cols(); ++i) {
-                Q.col(i) = Y.col(kdtree.closest(X.col(i).data()));
+                Q.col(i) = Y.col(ids(i));
             }
             /// Computer rotation and translation
             for(int outer=0; outer<par.max_outer; ++outer) {
@@ -490,35 +726,55 @@ namespace ICP {
             /// Stopping criteria
             double stop2 = (X-Xo2).colwise().norm().maxCoeff();
             Xo2 = X;
-            if(stop2 < par.stop) break;
+            if(stop2 < par.stop) {
+                if(eps == 0.0f) break;
+                exact = true; /// converged on approximate neighbours: confirm with exact ones
+            }
         }
     }
+    /// Reweighted ICP with point to point
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
+    /// @param Parameters
+    template <typename Derived1, typename Derived2>
+    void point_to_point(Eigen::MatrixBase<Derived1>& X,
+                        Eigen::MatrixBase<Derived2>& Y,
+                        Parameters par = Parameters()) {
+        /// Build kd-tree
+        nanoflann::KDTreeAdaptor<Eigen::MatrixBase<Derived2>, Derived1::RowsAtCompileTime, nanoflann::metric_L2_Fixed<Derived1::RowsAtCompileTime> > kdtree(Y);
+        point_to_point(X, Y, kdtree, par);
+    }
     /// Reweighted ICP with point to plane
-    /// @param Source (one 3D point per column)
-    /// @param Target (one 3D point per column)
-    /// @param Target normals (one 3D normal per column)
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
+    /// @param Target normals (one 2D or 3D normal per column)
+    /// @param KD-tree over the target, built once and reused (e.g. nanoflann::KDTreeIndex::tree())
     /// @param Parameters
-    template <typename Derived1, typename Derived2, typename Derived3>
+    template <typename Derived1, typename Derived2, typename Derived3, typename KDTree>
     void point_to_plane(Eigen::MatrixBase<Derived1>& X,
                         Eigen::MatrixBase<Derived2>& Y,
                         Eigen::MatrixBase<Derived3>& N,
-                        Parameters par = Parameters()) {
-        /// Build kd-tree
-        nanoflann::KDTreeAdaptor<Eigen::MatrixBase<Derived2>, 3, nanoflann::metric_L2_Simple> kdtree(Y);
+                        const KDTree& kdtree,
+                        Parameters par) {
+        enum { Dim = Derived1::RowsAtCompileTime };
+        typedef Eigen::Matrix<double, Dim, Eigen::Dynamic> MatrixDX;
         /// Buffers
-        Eigen::Matrix3Xd Qp = Eigen::Matrix3Xd::Zero(3, X.cols());
-        Eigen::Matrix3Xd Qn = Eigen::Matrix3Xd::Zero(3, X.cols());
+        MatrixDX Qp = MatrixDX::Zero(Dim, X.cols());
+        MatrixDX Qn = MatrixDX::Zero(Dim, X.cols());
         Eigen::VectorXd W = Eigen::VectorXd::Zero(X.cols());
-        Eigen::Matrix3Xd Xo1 = X;
-        Eigen::Matrix3Xd Xo2 = X;
+        MatrixDX Xo1 = X;
+        MatrixDX Xo2 = X;
+        Eigen::VectorXi ids;
+        bool exact = false;
         /// ICP
         for(int icp=0; icp<par.max_icp; ++icp) {
-            /// Find closest point
+            /// Find closest point, approximately in the first iterations
+            const float eps = exact ? 0.0f : nanoflann::scheduled_eps(par.eps, icp, par.max_icp, par.exact_icp);
+            nanoflann::closest_points(kdtree, X, eps, par.stats, ids);
             #pragma omp parallel for
             for(int i=0; i<X.cols(); ++i) {
-                int id = kdtree.closest(X.col(i).data());
-                Qp.col(i) = Y.col(id);
-                Qn.col(i) = N.col(id);
+                Qp.col(i) = Y.col(ids(i));
+                Qn.col(i) = N.col(ids(i));
             }
             /// Computer rotation and translation
             for(int outer=0; outer<par.max_outer; ++outer) {
@@ -535,9 +791,26 @@ namespace ICP {
             /// Stopping criteria
             double stop2 = (X-Xo2).colwise().norm().maxCoeff() ;
             Xo2 = X;
-            if(stop2 < par.stop) break;
+            if(stop2 < par.stop) {
+                if(eps == 0.0f) break;
+                exact = true; /// converged on approximate neighbours: confirm with exact ones
+            }
         }
     }
+    /// Reweighted ICP with point to plane
+    /// @param Source (one 2D or 3D point per column)
+    /// @param Target (one 2D or 3D point per column)
+    /// @param Target normals (one 2D or 3D normal per column)
+    /// @param Parameters
+    template <typename Derived1, typename Derived2, typename Derived3>
+    void point_to_plane(Eigen::MatrixBase<Derived1>& X,
+                        Eigen::MatrixBase<Derived2>& Y,
+                        Eigen::MatrixBase<Derived3>& N,
+                        Parameters par = Parameters()) {
+        /// Build kd-tree
+        nanoflann::KDTreeAdaptor<Eigen::MatrixBase<Derived2>, Derived1::RowsAtCompileTime, nanoflann::metric_L2_Fixed<Derived1::RowsAtCompileTime> > kdtree(Y);
+        point_to_plane(X, Y, N, kdtree, par);
+    }
 }
 ///////////////////////////////////////////////////////////////////////////////
 #endif
@@ -0,0 +1,103 @@
+#ifndef BEAM_GEOMETRY_HPP
+#define BEAM_GEOMETRY_HPP
+
+#include <cmath>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <sensor_msgs/LaserScan.h>
+
+/**
+ * \brief Unit vectors of the beams of a laser scanner.
+ *
+ * A sensor is identified by its (angle_min, angle_increment, count) signature,
+ * which does not change from scan to scan, so the trigonometry is done once.
+ */
+struct BeamGeometry {
+  typedef boost::shared_ptr<const BeamGeometry> ConstPtr;
+
+  float angle_min;
+  float angle_increment;
+  size_t count;
+  std::vector<float> cos_th; // cos of each beam angle
+  std::vector<float> sin_th; // sin of each beam angle
+
+  BeamGeometry(float angle_min_, float angle_increment_, size_t count_) :
+    angle_min(angle_min_), angle_increment(angle_increment_), count(count_), cos_th(count_), sin_th(count_) {
+    for (size_t i = 0; i < count; i++) {
+      const double th = angle_min + i * angle_increment;
+      cos_th[i] = cos(th);
+      sin_th[i] = sin(th);
+    }
+  }
+
+  inline bool matches(float angle_min_, float angle_increment_, size_t count_) const {
+    return angle_min == angle_min_ && angle_increment == angle_increment_ && count == count_;
+  }
+};
+
+/**
+ * \brief Shared beam geometry for the given scan signature, created on first use.
+ *
+ * Thread-safe. There is typically one entry per laser scanner.
+ */
+inline BeamGeometry::ConstPtr beam_geometry(float angle_min, float angle_increment, size_t count) {
+  static std::vector<BeamGeometry::ConstPtr> cache;
+  static boost::mutex cache_mutex;
+
+  boost::mutex::scoped_lock lock(cache_mutex);
+  for (size_t i = 0; i < cache.size(); i++)
+    if (cache[i]->matches(angle_min, angle_increment, count))
+      return cache[i];
+
+  cache.push_back(BeamGeometry::ConstPtr(new BeamGeometry(angle_min, angle_increment, count)));
+  return cache.back();
+}
+
+/**
+ * \brief Shared beam geometry of a laser scan
+ */
+inline BeamGeometry::ConstPtr beam_geometry(const sensor_msgs::LaserScan& scan) {
+  return beam_geometry(scan.angle_min, scan.angle_increment, scan.ranges.size());
+}
+
+/**
+ * \brief Project the beams of a scan in a frame rotated by th and translated by (tx, ty).
+ *
+ * Writes one point per beam in `stride`, valid or not: beam k*stride goes to x[k] and y[k],
+ * for (count + stride - 1) / stride points. With stride 1 the loop is a plain multiply-add
+ * over contiguous arrays and vectorizes.
+ */
+inline void project_beams(const BeamGeometry& beams, const float* ranges,
+                          double tx, double ty, double th, float* x, float* y, size_t stride = 1) {
+  if (beams.count == 0)
+    return;
+  const float c = cos(th), s = sin(th);
+  const float ftx = tx, fty = ty;
+  const float* cos_th = &beams.cos_th[0];
+  const float* sin_th = &beams.sin_th[0];
+  for (size_t i = 0, k = 0; i < beams.count; i += stride, k++) {
+    const float ux = c * cos_th[i] - s * sin_th[i];
+    const float uy = s * cos_th[i] + c * sin_th[i];
+    x[k] = ftx + ranges[i] * ux;
+    y[k] = fty + ranges[i] * uy;
+  }
+}
+
+/**
+ * \brief Project all beams of a scan in the sensor frame
+ */
+inline void project_beams(const BeamGeometry& beams, const float* ranges, float* x, float* y) {
+  if (beams.count == 0)
+    return;
+  const float* cos_th = &beams.cos_th[0];
+  const float* sin_th = &beams.sin_th[0];
+  for (size_t i = 0; i < beams.count; i++) {
+    x[i] = ranges[i] * cos_th[i];
+    y[i] = ranges[i] * sin_th[i];
+  }
+}
+
+#endif
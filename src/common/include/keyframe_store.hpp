@@ -0,0 +1,112 @@
+#ifndef KEYFRAME_STORE_HPP
+#define KEYFRAME_STORE_HPP
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+#include <geometry_msgs/Pose2D.h>
+
+#include "common/Keyframe.h"
+#include "common/Pose2DWithCovariance.h"
+
+/**
+ * \brief Keyframes by index, with their optimized poses apart from their sensor data.
+ *
+ * The optimized poses and the IDs are kept in contiguous arrays, so loops over
+ * poses do not walk over the scans and point clouds. The rest of each keyframe
+ * message is kept in a payload arena, where it never moves once added. Keyframes
+ * are found from their ID in constant time.
+ */
+class KeyframeStore {
+public:
+  inline size_t size() const { return ids_.size(); }
+  inline bool empty() const { return ids_.empty(); }
+
+  void clear() {
+    ids_.clear();
+    x_.clear();
+    y_.clear();
+    theta_.clear();
+    payloads_.clear();
+    indices_.clear();
+  }
+
+  /**
+   * \brief Append a keyframe, with its pose_opti as the current pose. Returns its index.
+   *
+   * A keyframe with an ID already in the store is not added: the index of the existing one is returned.
+   */
+  size_t add(const common::Keyframe& keyframe) {
+    std::pair<boost::unordered_map<int, size_t>::iterator, bool> inserted =
+      indices_.insert(std::make_pair(keyframe.id, ids_.size()));
+    if (!inserted.second)
+      return inserted.first->second;
+
+    ids_.push_back(keyframe.id);
+    x_.push_back(keyframe.pose_opti.pose.x);
+    y_.push_back(keyframe.pose_opti.pose.y);
+    theta_.push_back(keyframe.pose_opti.pose.theta);
+    payloads_.push_back(keyframe);
+    payloads_.back().pose_opti.pose = geometry_msgs::Pose2D(); // the arrays hold the current pose
+    return ids_.size() - 1;
+  }
+
+  /// Index of the keyframe with ID `id`, -1 if there is none
+  inline int index(int id) const {
+    boost::unordered_map<int, size_t>::const_iterator it = indices_.find(id);
+    return it == indices_.end() ? -1 : int(it->second);
+  }
+  inline bool contains(int id) const { return indices_.find(id) != indices_.end(); }
+
+  inline int id(size_t i) const { return ids_[i]; }
+  inline double x(size_t i) const { return x_[i]; }
+  inline double y(size_t i) const { return y_[i]; }
+  inline double theta(size_t i) const { return theta_[i]; }
+
+  inline geometry_msgs::Pose2D pose(size_t i) const {
+    geometry_msgs::Pose2D pose;
+    pose.x = x_[i];
+    pose.y = y_[i];
+    pose.theta = theta_[i];
+    return pose;
+  }
+  inline void set_pose(size_t i, double x, double y, double theta) {
+    x_[i] = x;
+    y_[i] = y;
+    theta_[i] = theta;
+  }
+
+  /// Current pose, with the covariance of the keyframe
+  inline common::Pose2DWithCovariance pose_opti(size_t i) const {
+    common::Pose2DWithCovariance pose_opti = payloads_[i].pose_opti;
+    pose_opti.pose = pose(i);
+    return pose_opti;
+  }
+
+  /// Sensor data of the keyframe: its pose_opti pose is not kept, use pose() instead
+  inline const common::Keyframe& payload(size_t i) const { return payloads_[i]; }
+
+  /// Full keyframe message, with the current pose
+  common::Keyframe keyframe(size_t i) const {
+    common::Keyframe keyframe = payloads_[i];
+    keyframe.pose_opti.pose = pose(i);
+    return keyframe;
+  }
+
+  /// Append the keyframes from index `begin` on to `keyframes`
+  void keyframes(size_t begin, std::vector<common::Keyframe>& keyframes) const {
+    keyframes.reserve(keyframes.size() + size() - std::min(begin, size()));
+    for (size_t i = begin; i < size(); i++)
+      keyframes.push_back(keyframe(i));
+  }
+
+private:
+  std::vector<int> ids_;
+  std::vector<double> x_, y_, theta_; // optimized pose
+  std::deque<common::Keyframe> payloads_; // the rest of the keyframe messages
+  boost::unordered_map<int, size_t> indices_; // index of each ID
+};
+
+#endif
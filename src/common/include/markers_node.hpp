@@ -0,0 +1,14 @@
+#ifndef MARKERS_NODE_HPP
+#define MARKERS_NODE_HPP
+
+#include <ros/ros.h>
+
+/**
+ * \brief Start the markers on the node handle `n`: publishers, graph subscriber and publishing timer.
+ *
+ * Shared by the standalone node and the nodelet. The markers state is process-wide:
+ * one instance per process.
+ */
+void markers_start(ros::NodeHandle& n);
+
+#endif
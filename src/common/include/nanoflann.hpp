@@ -364,6 +364,42 @@ namespace nanoflann
 		}
 	};
 
+	/** Squared Euclidean distance functor for a dimensionality known at compile time.
+	  *  The per-dimension loop has a fixed trip count, which the compiler unrolls.
+	  *
+	  *  Corresponding distance traits: nanoflann::metric_L2_Fixed<DIM>
+	  *
+	  *  \tparam T Type of the elements (e.g. double, float)
+	  *  \tparam DataSource Source of the data, i.e. where the vectors are stored
+	  *  \tparam DIM Dimensionality of the points
+	  *  \tparam _DistanceType Type of distance variables (must be signed)
+	  */
+	template<class T, class DataSource, int DIM, typename _DistanceType = T>
+	struct L2_Fixed_Adaptor
+	{
+		typedef T ElementType;
+		typedef _DistanceType DistanceType;
+
+		const DataSource &data_source;
+
+		L2_Fixed_Adaptor(const DataSource &_data_source) : data_source(_data_source) { }
+
+		inline DistanceType operator()(const T* a, const size_t b_idx, size_t /*size*/ = DIM) const {
+			DistanceType result = DistanceType();
+			for (int d = 0; d < DIM; ++d) {
+				const DistanceType diff = a[d] - data_source.kdtree_get_pt(b_idx, d);
+				result += diff * diff;
+			}
+			return result;
+		}
+
+		template <typename U, typename V>
+		inline DistanceType accum_dist(const U a, const V b, int) const
+		{
+			return (a-b)*(a-b);
+		}
+	};
+
 	/** Metaprogramming helper traits class for the L1 (Manhattan) metric */
 	struct metric_L1 {
 		template<class T, class DataSource>
@@ -378,6 +414,14 @@ namespace nanoflann
 			typedef L2_Adaptor<T,DataSource> distance_t;
 		};
 	};
+	/** Metaprogramming helper traits class for the L2 (Euclidean) metric with a compile-time dimensionality */
+	template <int DIM>
+	struct metric_L2_Fixed {
+		template<class T, class DataSource>
+		struct traits {
+			typedef L2_Fixed_Adaptor<T,DataSource,DIM> distance_t;
+		};
+	};
 	/** Metaprogramming helper traits class for the L2_simple (Euclidean) metric */
 	struct metric_L2_Simple {
 		template<class T, class DataSource>
@@ -409,15 +453,28 @@ namespace nanoflann
 	struct SearchParams
 	{
 		/** Note: The first argument (checks_IGNORED_) is ignored, but kept for compatibility with the FLANN interface */
-		SearchParams(int checks_IGNORED_ = 32, float eps_ = 0, bool sorted_ = true ) :
-            eps(eps_), sorted(sorted_) {
+		SearchParams(int checks_IGNORED_ = 32, float eps_ = 0, bool sorted_ = true, size_t* visits_ = NULL ) :
+            eps(eps_), sorted(sorted_), visits(visits_) {
             checks_IGNORED_ = checks_IGNORED_;
         }
 
 		int   checks;  //!< Ignored parameter (Kept for compatibility with the FLANN interface).
 		float eps;  //!< search for eps-approximate neighbours (default: 0)
 		bool sorted; //!< only for radius search, require neighbours sorted by distance (default: true)
+		size_t* visits; //!< if not NULL, incremented by the number of tree nodes visited by the search (default: NULL)
 	};
+
+	/** Search epsilon of ICP iteration \a icp: \a eps at the first iteration, halved at each one,
+	  * and exact (0) once below \a min_eps or in the \a exact_icp last iterations of \a max_icp */
+	inline float scheduled_eps(float eps, int icp, int max_icp, int exact_icp, float min_eps = 0.05f)
+	{
+		if (eps <= 0.0f || icp >= max_icp - exact_icp) return 0.0f;
+		eps = std::ldexp(eps, -icp);
+		return eps < min_eps ? 0.0f : eps;
+	}
+
+	/** One approximate search in this many is repeated exactly, to measure the node visits the approximation saves */
+	const int search_reference_stride = 16;
 	/** @} */
 
 
@@ -794,9 +851,14 @@ namespace nanoflann
 			assert(vec);
 			float epsError = 1+searchParams.eps;
 
-			std::vector<DistanceType> dists( (DIM>0 ? DIM : dim) ,0);
+			// per-dimension distances to the current cell: on the stack when the dimensionality is fixed
+			DistanceType dists_fixed[DIM>0 ? DIM : 1];
+			std::vector<DistanceType> dists_dynamic;
+			DistanceType* dists = dists_fixed;
+			if (DIM>0) std::fill(dists_fixed, dists_fixed + (DIM>0 ? DIM : 1), DistanceType(0));
+			else { dists_dynamic.assign(dim, 0); dists = &dists_dynamic[0]; }
 			DistanceType distsq = computeInitialDistances(vec, dists);
-			searchLevel(result, vec, root_node, distsq, dists, epsError);  // "count_leaf" parameter removed since was neither used nor returned to the user.
+			searchLevel(result, vec, root_node, distsq, dists, epsError, searchParams.visits);  // "count_leaf" parameter removed since was neither used nor returned to the user.
 		}
 
 		/**
@@ -1100,7 +1162,7 @@ namespace nanoflann
 			lim2 = left;
 		}
 
-		DistanceType computeInitialDistances(const ElementType* vec, std::vector<DistanceType>& dists) const
+		DistanceType computeInitialDistances(const ElementType* vec, DistanceType* dists) const
 		{
 			assert(vec);
 			DistanceType distsq = 0.0;
@@ -1125,8 +1187,10 @@ namespace nanoflann
 		 */
 		template <class RESULTSET>
 		void searchLevel(RESULTSET& result_set, const ElementType* vec, const NodePtr node, DistanceType mindistsq,
-						 std::vector<DistanceType>& dists, const float epsError) const
+						 DistanceType* dists, const float epsError, size_t* visits) const
 		{
+			if (visits) ++*visits;
+
 			/* If this is a leaf node, then do check and return. */
 			if ((node->child1 == NULL)&&(node->child2 == NULL)) {
 				//count_leaf += (node->lr.right-node->lr.left);  // Removed since was neither used nor returned to the user.
@@ -1162,13 +1226,13 @@ namespace nanoflann
 			}
 
 			/* Call recursively to search next level down. */
-			searchLevel(result_set, vec, bestChild, mindistsq, dists, epsError);
+			searchLevel(result_set, vec, bestChild, mindistsq, dists, epsError, visits);
 
 			DistanceType dst = dists[idx];
 			mindistsq = mindistsq + cut_dist - dst;
 			dists[idx] = cut_dist;
 			if (mindistsq*epsError<=result_set.worstDist()) {
-				searchLevel(result_set, vec, otherChild, mindistsq, dists, epsError);
+				searchLevel(result_set, vec, otherChild, mindistsq, dists, epsError, visits);
 			}
 			dists[idx] = dst;
 		}
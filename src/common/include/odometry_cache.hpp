@@ -0,0 +1,95 @@
+#ifndef ODOMETRY_CACHE_HPP
+#define ODOMETRY_CACHE_HPP
+
+#include <cmath>
+#include <deque>
+#include <algorithm>
+
+#include <ros/ros.h>
+#include <geometry_msgs/Pose2D.h>
+
+#include "common/Odometry.h"
+
+/**
+ * \brief Time-ordered buffer of odometry poses, with interpolated lookups.
+ *
+ * Holds the last `capacity` samples. Lookups between two samples interpolate
+ * linearly; lookups slightly past either end (up to `tolerance` seconds) take
+ * the end sample, so a scan stamped just after the last odometry message is
+ * still served.
+ */
+class OdometryCache {
+public:
+  explicit OdometryCache(size_t capacity = 2000, double tolerance = 0.05) :
+    capacity_(capacity), tolerance_(tolerance) {}
+
+  inline size_t size() const { return buffer_.size(); }
+  inline bool empty() const { return buffer_.empty(); }
+  inline void clear() { buffer_.clear(); }
+
+  /**
+   * \brief Append a sample. Samples older than the newest one are dropped.
+   */
+  void add(const common::Odometry& odometry) {
+    if (!buffer_.empty() && odometry.ts < buffer_.back().ts)
+      return;
+    if (buffer_.size() >= capacity_)
+      buffer_.pop_front();
+    buffer_.push_back(odometry);
+  }
+
+  /**
+   * \brief Odometry pose at time `t`. Returns false if `t` is not covered by the buffer.
+   */
+  bool pose_at(const ros::Time& t, geometry_msgs::Pose2D& pose) const {
+    if (buffer_.empty())
+      return false;
+
+    // compare durations: ts - tolerance is out of ros::Time range for ts < tolerance (sim time starts at 0)
+    if ((t - buffer_.front().ts).toSec() < -tolerance_ || (t - buffer_.back().ts).toSec() > tolerance_)
+      return false;
+    if (t <= buffer_.front().ts) {
+      pose = buffer_.front().pose.pose;
+      return true;
+    }
+    if (t >= buffer_.back().ts) {
+      pose = buffer_.back().pose.pose;
+      return true;
+    }
+
+    // first sample not older than t: the buffer is sorted by time
+    std::deque<common::Odometry>::const_iterator after =
+        std::lower_bound(buffer_.begin(), buffer_.end(), t, older_than);
+    std::deque<common::Odometry>::const_iterator before = after - 1;
+
+    const double span = (after->ts - before->ts).toSec();
+    const double alpha = span > 0 ? (t - before->ts).toSec() / span : 0;
+    const geometry_msgs::Pose2D& p0 = before->pose.pose;
+    const geometry_msgs::Pose2D& p1 = after->pose.pose;
+    const double dth = std::atan2(std::sin(p1.theta - p0.theta), std::cos(p1.theta - p0.theta)); // shortest way round
+
+    pose.x = p0.x + alpha * (p1.x - p0.x);
+    pose.y = p0.y + alpha * (p1.y - p0.y);
+    pose.theta = p0.theta + alpha * dth;
+    return true;
+  }
+
+  /**
+   * \brief Odometry poses at `t_start` and `t_end`. Returns false unless both are covered.
+   */
+  bool poses_between(const ros::Time& t_start, const ros::Time& t_end,
+                     geometry_msgs::Pose2D& pose_start, geometry_msgs::Pose2D& pose_end) const {
+    return pose_at(t_start, pose_start) && pose_at(t_end, pose_end);
+  }
+
+private:
+  static bool older_than(const common::Odometry& odometry, const ros::Time& t) {
+    return odometry.ts < t;
+  }
+
+  size_t capacity_;
+  double tolerance_; // seconds
+  std::deque<common::Odometry> buffer_;
+};
+
+#endif
@@ -10,6 +10,7 @@
 #include <tf/transform_broadcaster.h>
 #include <visualization_msgs/Marker.h>
 #include <visualization_msgs/MarkerArray.h>
+#include "beam_geometry.hpp"
 
 //#######################
 //#### Add Map Saving Service
@@ -21,13 +22,19 @@ void graph_callback(const common::Graph& input) {
   pose_optis.poses.clear();
   
   for(int i = 0; i < input.keyframes.size(); i++) {
-    for(int j = 0; j < input.keyframes[i].scan.ranges.size(); j+=25) {
+    const sensor_msgs::LaserScan& scan = input.keyframes[i].scan;
+    const geometry_msgs::Pose2D& pose = input.keyframes[i].pose_opti.pose;
+    if(scan.ranges.empty())
+      continue;
+
+    // one point in 25, from the cached beam unit vectors: no trigonometry per beam
+    const size_t points = (scan.ranges.size() + 24) / 25;
+    std::vector<float> x(points), y(points);
+    project_beams(*beam_geometry(scan), &scan.ranges[0], pose.x, pose.y, pose.theta, &x[0], &y[0], 25);
+    for(size_t j = 0; j < points; j++) {
       geometry_msgs::Point pnt;
-      double th = std::fmod(input.keyframes[i].pose_opti.pose.theta +
-			    input.keyframes[i].scan.angle_min +
-       			    ( j * input.keyframes[i].scan.angle_increment ) + M_PI, 2 * M_PI ) - M_PI;
-      pnt.x = input.keyframes[i].pose_opti.pose.x + ( input.keyframes[i].scan.ranges[j] * cos( th ) );
-      pnt.y = input.keyframes[i].pose_opti.pose.y + ( input.keyframes[i].scan.ranges[j] * sin( th ) );
+      pnt.x = x[j];
+      pnt.y = y[j];
       scan_marker_point.points.push_back(pnt);
     }
   }
@@ -5,109 +5,251 @@
 #include <common/Factor.h>
 #include <common/Keyframe.h>
 #include <common/Graph.h>
+#include <common/GraphUpdate.h>
+#include <common/GraphSnapshot.h>
 #include <geometry_msgs/PoseArray.h>
 #include <geometry_msgs/Pose2D.h>
 #include <tf/transform_broadcaster.h>
 #include <visualization_msgs/Marker.h>
 #include <visualization_msgs/MarkerArray.h>
+#include "beam_geometry.hpp"
+#include "keyframe_store.hpp"
+#include "markers_node.hpp"
+
+namespace {
+
+ros::Publisher keyframe_marker_pub;
+ros::Publisher loop_marker_pub;
+ros::Publisher scan_marker_point_pub;
+ros::Publisher pose_array_pub;
+ros::Subscriber graph_update_sub;
+ros::ServiceClient graph_snapshot_client;
+ros::Timer publish_timer;
+
+// Local copy of the graph, kept current by the graph update stream
+KeyframeStore keyframes;
+std::vector<common::Factor> factors;
+unsigned int graph_version = 0; // last update applied
 
 geometry_msgs::PoseArray pose_optis;
 visualization_msgs::Marker keyframe_points, keyframe_line_strip; //, keyframe_line_list;
 visualization_msgs::Marker loop_points, loop_line_list;
 visualization_msgs::Marker scan_marker_point;
 
-void graph_callback(const common::Graph& input) {
+// Marker entries of each keyframe, by index in keyframes: one pose, position and line strip
+// vertex each, and the scan points from scan_offsets[k]. Loops have two entries each
+std::vector<size_t> scan_offsets;
+std::vector<std::pair<size_t, size_t> > loops; // keyframe indices of the loops drawn
+std::vector<std::vector<size_t> > keyframe_loops; // loops drawn from or to each keyframe
+
+const size_t scan_marker_stride = 25; // one scan point in 25 is drawn
+
+/// Number of scan points drawn for a scan
+inline size_t scan_marker_points(const sensor_msgs::LaserScan& scan) {
+  return (scan.ranges.size() + scan_marker_stride - 1) / scan_marker_stride;
+}
+
+/**
+ * \brief Markers of keyframe `k`: pose arrow, position and scan points, at its current pose
+ */
+void keyframe_markers(size_t k) {
+  const geometry_msgs::Pose2D pose_opti = keyframes.pose(k);
+
+  // pose arrow
+  geometry_msgs::Pose& pose = pose_optis.poses[k];
+  pose.position.x = pose_opti.x;
+  pose.position.y = pose_opti.y;
+  pose.orientation = tf::createQuaternionMsgFromYaw(pose_opti.theta);
+
+  // position, also a vertex of the line strip of all motions
+  geometry_msgs::Point pnt;
+  pnt.x = pose_opti.x;
+  pnt.y = pose_opti.y;
+  keyframe_line_strip.points[k] = pnt;
+  keyframe_points.points[k] = pnt;
+
+  // scan points, from the cached beam unit vectors: no trigonometry per beam
+  const sensor_msgs::LaserScan& scan = keyframes.payload(k).scan;
+  const size_t points = scan_marker_points(scan);
+  if(points == 0)
+    return;
+  std::vector<float> x(points), y(points);
+  project_beams(*beam_geometry(scan), &scan.ranges[0], pose_opti.x, pose_opti.y, pose_opti.theta,
+                &x[0], &y[0], scan_marker_stride);
+  for(size_t p = 0; p < points; p++) {
+    geometry_msgs::Point& scan_pnt = scan_marker_point.points[scan_offsets[k] + p];
+    scan_pnt.x = x[p];
+    scan_pnt.y = y[p];
+  }
+}
+
+/**
+ * \brief Markers of loop `l`: its two end points, and the segment between them
+ */
+void loop_markers(size_t l) {
+  for(int e = 0; e < 2; e++) {
+    const size_t k = e == 0 ? loops[l].first : loops[l].second;
+    geometry_msgs::Point pnt;
+    pnt.x = keyframes.x(k);
+    pnt.y = keyframes.y(k);
+    loop_points.points[2*l + e] = pnt;
+    loop_line_list.points[2*l + e] = pnt;
+  }
+}
+
+/**
+ * \brief Append the markers of keyframe `k`, the last one of the local copy
+ */
+void append_keyframe(size_t k) {
+  pose_optis.poses.push_back(geometry_msgs::Pose());
+  keyframe_points.points.push_back(geometry_msgs::Point());
+  keyframe_line_strip.points.push_back(geometry_msgs::Point());
+  scan_offsets.push_back(scan_marker_point.points.size());
+  scan_marker_point.points.resize(scan_marker_point.points.size() + scan_marker_points(keyframes.payload(k).scan));
+  keyframe_loops.push_back(std::vector<size_t>());
+  keyframe_markers(k);
+}
+
+/**
+ * \brief Append the markers of a factor, if it closes a loop between two known keyframes
+ */
+void append_factor(const common::Factor& factor) {
+  if(!factor.loop || factor.id_1 == factor.id_2)
+    return;
+  const int k_1 = keyframes.index(factor.id_1);
+  const int k_2 = keyframes.index(factor.id_2);
+  if(k_1 < 0 || k_2 < 0)
+    return;
+
+  const size_t l = loops.size();
+  loops.push_back(std::make_pair(size_t(k_1), size_t(k_2)));
+  keyframe_loops[k_1].push_back(l);
+  keyframe_loops[k_2].push_back(l);
+  loop_points.points.resize(2*loops.size());
+  loop_line_list.points.resize(2*loops.size());
+  loop_markers(l);
+}
+
+/**
+ * \brief Move the markers of keyframe `k`, and of the loops it closes, to its current pose
+ */
+void move_keyframe(size_t k) {
+  keyframe_markers(k);
+  for(int i = 0; i < keyframe_loops[k].size(); i++)
+    loop_markers(keyframe_loops[k][i]);
+}
+
+/**
+ * \brief Remove all markers
+ */
+void clear_markers() {
   pose_optis.poses.clear();
   keyframe_points.points.clear();
   keyframe_line_strip.points.clear();
   loop_points.points.clear();
   loop_line_list.points.clear();
   scan_marker_point.points.clear();
-  
-  // loop all keyframes
-  for(int i = 0; i < input.keyframes.size(); i++) {
-    // create pose
-    geometry_msgs::Pose pose;
-    pose.position.x = input.keyframes[i].pose_opti.pose.x;
-    pose.position.y = input.keyframes[i].pose_opti.pose.y;
-    pose.orientation = tf::createQuaternionMsgFromYaw(input.keyframes[i].pose_opti.pose.theta);
-
-    // append arrow marker
-    pose_optis.poses.push_back(pose);
-
-    // create point
-    geometry_msgs::Point pnt;
-    pnt.x = pose.position.x;
-    pnt.y = pose.position.y;
+  scan_offsets.clear();
+  loops.clear();
+  keyframe_loops.clear();
+}
 
-    // append position and motion factor markers to the line strip of all motions
-    keyframe_line_strip.points.push_back(pnt);
-    keyframe_points.points.push_back(pnt);
-  }
+/**
+ * \brief Rebuild all markers from the local copy of the graph, after a snapshot
+ */
+void rebuild_markers() {
+  clear_markers();
+  for(int k = 0; k < keyframes.size(); k++)
+    append_keyframe(k);
+  for(int i = 0; i < factors.size(); i++)
+    append_factor(factors[i]);
+}
 
-  // loop all factors looking for loop closures
-  for(int i = 0; i < input.factors.size(); i++) {
-      if(input.factors[i].loop) {
-    geometry_msgs::Pose2D pose_1, pose_2;
-    bool p_1_found = false;
-    bool p_2_found = false;
-      
-    // find 1st keyframe
-    for(int j = 0; j < input.keyframes.size(); j++) {
-      if(input.keyframes[j].id == input.factors[i].id_1) {
-	pose_1 = input.keyframes[j].pose_opti.pose;
-	p_1_found = true;
-      }
-    }
+/**
+ * \brief Replace the local copy of the graph by a snapshot from the graph node
+ */
+bool request_snapshot() {
+  common::GraphSnapshot snapshot;
+  if(!graph_snapshot_client.call(snapshot))
+    return false;
+  keyframes.clear();
+  for(int i = 0; i < snapshot.response.graph.keyframes.size(); i++)
+    keyframes.add(snapshot.response.graph.keyframes[i]);
+  factors.swap(snapshot.response.graph.factors);
+  graph_version = snapshot.response.version;
+  return true;
+}
 
-    // find 2nd keyframe
-    for(int j = 0; j < input.keyframes.size(); j++) {
-      if(input.keyframes[j].id == input.factors[i].id_2) {
-	pose_2 = input.keyframes[j].pose_opti.pose;
-	p_2_found = true;
-      }
-    }
+/**
+ * \brief Callback at the reception of a graph update: apply it to the local copy of the graph.
+ *
+ * The first update, or one that follows a missed one, is preceded by a snapshot,
+ * which may already include it, and after which all markers are rebuilt. Otherwise
+ * only the markers of the new keyframes and factors are added, and those of the
+ * moved keyframes updated.
+ */
+void graph_update_callback(const common::GraphUpdate& input) {
+  if(input.version == 1) { // first update of a (re)started graph
+    keyframes.clear();
+    factors.clear();
+    graph_version = 0;
+    clear_markers();
+  }
 
-    // append loop points and factors
-    if(p_1_found && p_2_found && input.factors[i].id_1 != input.factors[i].id_2 ) {
-      geometry_msgs::Point pnt_1;
-      pnt_1.x = pose_1.x;
-      pnt_1.y = pose_1.y;
-      geometry_msgs::Point pnt_2;
-      pnt_2.x = pose_2.x;
-      pnt_2.y = pose_2.y;
-      
-      loop_points.points.push_back(pnt_1);
-      loop_points.points.push_back(pnt_2);
-      loop_line_list.points.push_back(pnt_1);
-      loop_line_list.points.push_back(pnt_2);
-      }
+  if(input.version != graph_version + 1) {
+    if(!request_snapshot()) {
+      ROS_WARN("MARKERS: graph update %u missed, and no snapshot available", input.version);
+      return;
     }
+    rebuild_markers();
+    if(input.version <= graph_version)
+      return;
   }
 
-  
-  for(int i = 0; i < input.keyframes.size(); i++) {
-    for(int j = 0; j < input.keyframes[i].scan.ranges.size(); j+=25) {
-      geometry_msgs::Point pnt;
-      double th = std::fmod(input.keyframes[i].pose_opti.pose.theta +
-			    input.keyframes[i].scan.angle_min +
-       			    ( j * input.keyframes[i].scan.angle_increment ) + M_PI, 2 * M_PI ) - M_PI;
-      pnt.x = input.keyframes[i].pose_opti.pose.x + ( input.keyframes[i].scan.ranges[j] * cos( th ) );
-      pnt.y = input.keyframes[i].pose_opti.pose.y + ( input.keyframes[i].scan.ranges[j] * sin( th ) );
-      scan_marker_point.points.push_back(pnt);
-    }
+  for(int i = 0; i < input.keyframes_new.size(); i++) {
+    const size_t n = keyframes.size();
+    const size_t k = keyframes.add(input.keyframes_new[i]);
+    if(k == n) // not already in the local copy
+      append_keyframe(k);
+  }
+  for(int i = 0; i < input.factors_new.size(); i++) {
+    factors.push_back(input.factors_new[i]);
+    append_factor(input.factors_new[i]);
+  }
+  for(int i = 0; i < input.pose_ids.size(); i++) {
+    const int k = keyframes.index(input.pose_ids[i]);
+    if(k < 0)
+      continue;
+    keyframes.set_pose(k, input.poses[i].x, input.poses[i].y, input.poses[i].theta);
+    move_keyframe(k);
   }
+  graph_version = input.version;
 }
 
-int main( int argc, char** argv ) {
-  ros::init(argc, argv, "basic_shapes");
-  ros::NodeHandle n;
-  ros::Rate(100);
-  ros::Publisher keyframe_marker_pub = n.advertise<visualization_msgs::Marker>("keyframe_marker", 50);
-  ros::Publisher loop_marker_pub = n.advertise<visualization_msgs::Marker>("loop_marker", 50);
-  ros::Publisher scan_marker_point_pub = n.advertise<visualization_msgs::Marker>("scan_marker", 50);
-  ros::Publisher pose_array_pub = n.advertise<geometry_msgs::PoseArray>("/keyframe/poses", 50);
-  ros::Subscriber graph_sub = n.subscribe("/graph/graph", 1, graph_callback);
+/**
+ * \brief Publish the current markers
+ */
+void publish_markers(const ros::TimerEvent&) {
+  pose_array_pub.publish(pose_optis);
+  scan_marker_point_pub.publish(scan_marker_point);
+  keyframe_marker_pub.publish(keyframe_points);
+  loop_marker_pub.publish(loop_points);
+  keyframe_marker_pub.publish(keyframe_line_strip);
+  loop_marker_pub.publish(loop_line_list);
+}
+
+} // namespace
+
+/**
+ * \brief Start the markers: publishers, graph update subscriber, marker styles and publishing timer
+ */
+void markers_start(ros::NodeHandle& n) {
+  keyframe_marker_pub = n.advertise<visualization_msgs::Marker>("keyframe_marker", 50);
+  loop_marker_pub = n.advertise<visualization_msgs::Marker>("loop_marker", 50);
+  scan_marker_point_pub = n.advertise<visualization_msgs::Marker>("scan_marker", 50);
+  pose_array_pub = n.advertise<geometry_msgs::PoseArray>("/keyframe/poses", 50);
+  graph_snapshot_client = n.serviceClient<common::GraphSnapshot>("/graph/graph_snapshot");
+  graph_update_sub = n.subscribe("/graph/graph_update", 100, graph_update_callback);
 
   // Keyframe poses arrow markers
   pose_optis.header.frame_id = "odom";
@@ -180,17 +322,8 @@ int main( int argc, char** argv ) {
   loop_line_list.header.stamp = ros::Time::now();
   loop_line_list.ns = "loop_points_and_lines";
   loop_line_list.pose.orientation.w = 1.0;
-  
-  while(ros::ok()) {
-    pose_array_pub.publish(pose_optis);
-    scan_marker_point_pub.publish(scan_marker_point);
-    keyframe_marker_pub.publish(keyframe_points);
-    loop_marker_pub.publish(loop_points);
-    keyframe_marker_pub.publish(keyframe_line_strip);
-    loop_marker_pub.publish(loop_line_list);
-    ros::spinOnce();
-  }
 
-  return 0;
+  // markers are republished at 100 Hz, on the same callback queue as the graph updates
+  publish_timer = n.createTimer(ros::Duration(0.01), publish_markers);
 }
 
@@ -0,0 +1,14 @@
+#include "markers_node.hpp"
+
+/**
+ * \brief Main process: the markers as a standalone node
+ */
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "basic_shapes");
+  ros::NodeHandle n;
+
+  markers_start(n);
+  ros::spin();
+
+  return 0;
+}
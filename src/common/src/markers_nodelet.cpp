@@ -0,0 +1,23 @@
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "markers_node.hpp"
+
+namespace common {
+
+/**
+ * \brief The markers as a nodelet.
+ *
+ * Loaded in the same manager as the graph nodelet, graph messages are passed
+ * by pointer instead of being serialized.
+ */
+class MarkersNodelet : public nodelet::Nodelet {
+private:
+  virtual void onInit() {
+    markers_start(getNodeHandle());
+  }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(common::MarkersNodelet, nodelet::Nodelet)
@@ -1,6 +1,7 @@
 #include <nav_msgs/Odometry.h>
 #include <ICP.h>
 #include "utils.hpp"
+#include "beam_geometry.hpp"
 
 ros::Publisher delta_pub;
 
@@ -15,13 +16,31 @@ nav_msgs::Odometry robot_1_gt;
 nav_msgs::Odometry robot_0_gt;
 
 typedef double Scalar;
-typedef Eigen::Matrix<Scalar, 3, Eigen::Dynamic> Vertices;
-
-Vertices scan_to_vertices(sensor_msgs::LaserScan input) {
-  Vertices output;
-  for(int i = 0; i < input.ranges.size(); i++) {
-    output(2, i) = input.ranges[i];
+typedef Eigen::Matrix<Scalar, 2, Eigen::Dynamic> Vertices; // planar scans: 2D registration
+
+// Target vertices and their KD-tree, kept until the target scan changes
+nanoflann::KDTreeIndex<2, Scalar> target_index;
+ros::Time target_stamp;
+
+/**
+ * \brief Valid scan points, one per column, in the sensor frame
+ */
+Vertices scan_to_vertices(const sensor_msgs::LaserScan& input) {
+  const size_t n = input.ranges.size();
+  std::vector<float> x(n), y(n);
+  if(n > 0)
+    project_beams(*beam_geometry(input), &input.ranges[0], &x[0], &y[0]);
+
+  Vertices output(2, n);
+  int count = 0;
+  for(size_t i = 0; i < n; i++) {
+    if(input.ranges[i] >= input.range_min && input.ranges[i] < input.range_max) { // no-return beams are at range_max
+      output(0, count) = x[i];
+      output(1, count) = y[i];
+      count++;
+    }
   }
+  output.conservativeResize(2, count);
 
   return output;
 }
@@ -32,13 +51,27 @@ void sparseicp_register(sensor_msgs::LaserScan input_1,
   double start = ros::Time::now().toSec();
 
   Vertices vertices_source = scan_to_vertices(input_1);
-  Vertices vertices_target = scan_to_vertices(input_2);
+  if(target_index.size() == 0 || input_2.header.stamp != target_stamp) {
+    target_index.set(scan_to_vertices(input_2));
+    target_index.build();
+    target_stamp = input_2.header.stamp;
+  }
+  if(vertices_source.cols() == 0 || target_index.size() == 0)
+    return;
+  Vertices vertices_target = target_index.points();
 
+  // SICP moves the source in place: the transform is recovered from the moved points
+  Vertices vertices_aligned = vertices_source;
   SICP::Parameters pars;
   pars.p = .5;
   pars.max_icp = 15;
   pars.print_icpn = true;
-  SICP::point_to_point(vertices_source, vertices_source, pars);
+  SICP::point_to_point(vertices_aligned, vertices_target, target_index.tree(), pars);
+
+  Eigen::Affine2d transform_aligned = RigidMotionEstimator::point_to_point(vertices_source, vertices_aligned);
+  transform.setIdentity();
+  transform.topLeftCorner<2,2>() = transform_aligned.linear().cast<float>();
+  transform.block<2,1>(0,3) = transform_aligned.translation().cast<float>();
   
   geometry_msgs::Pose2D transform_Delta = make_Delta(transform);
   Eigen::MatrixXd covariance_Delta = compute_covariance(k_disp_disp,
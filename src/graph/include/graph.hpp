@@ -1,4 +1,6 @@
 #include <vector>
+#include <deque>
+#include <algorithm>
 #include <math.h>
 #include <iostream>
 #include <string>
@@ -9,6 +11,9 @@
 
 #include <common/Factor.h>
 #include <common/Keyframe.h>
+#include <common/KeyframeUpdate.h>
+#include <common/GraphUpdate.h>
+#include <common/GraphSnapshot.h>
 #include <common/ClosestKeyframe.h>
 #include <common/LastKeyframe.h>
 #include <common/Registration.h>
@@ -23,7 +28,13 @@
 #include <gtsam/nonlinear/Marginals.h>
 #include <gtsam/nonlinear/NonlinearFactorGraph.h>
 #include <gtsam/nonlinear/LevenbergMarquardtOptimizer.h>
+#include <gtsam/nonlinear/ISAM2.h>
 
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/classification.hpp>
 
@@ -0,0 +1,20 @@
+#ifndef GRAPH_NODE_HPP
+#define GRAPH_NODE_HPP
+
+#include <ros/ros.h>
+
+/**
+ * \brief Start the graph on the node handle `n`: parameters, publishers, subscribers, services
+ * and solver thread.
+ *
+ * Shared by the standalone node and the nodelet. The graph state is process-wide:
+ * one graph per process.
+ */
+void graph_start(ros::NodeHandle& n);
+
+/**
+ * \brief Stop the graph started by graph_start()
+ */
+void graph_stop();
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef KEYFRAME_GRID_HPP
+#define KEYFRAME_GRID_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
+
+namespace graph {
+
+/**
+ * \brief Uniform hash grid over the planar positions of the keyframes.
+ *
+ * Keyframes are referred to by their index in the graph's keyframe vector, and
+ * are inserted in increasing index order as they are created. Queries only consider
+ * the keyframes below an index `end`, so the most recent ones can be left out.
+ *
+ * Positions change when the graph is optimized: the grid is then rebuilt with
+ * clear() and insert().
+ */
+class KeyframeGrid {
+public:
+  /// (squared distance, keyframe index), as returned by the queries
+  typedef std::pair<double, size_t> Neighbor;
+
+  explicit KeyframeGrid(double cell_size = 2.0) :
+    cell_size_(cell_size), cx_min_(0), cx_max_(-1), cy_min_(0), cy_max_(-1) {}
+
+  /// Side of the square cells, in meters. Clears the grid
+  inline void setCellSize(double cell_size) { cell_size_ = cell_size; clear(); }
+  inline double getCellSize() const { return cell_size_; }
+
+  /// Number of keyframes in the grid
+  inline size_t size() const { return x_.size(); }
+
+  void clear() {
+    x_.clear();
+    y_.clear();
+    cells_.clear();
+    cx_min_ = cy_min_ = 0;
+    cx_max_ = cy_max_ = -1;
+  }
+
+  /// Insert the keyframe of index size() at (x, y)
+  void insert(double x, double y) {
+    const int cx = cell(x), cy = cell(y);
+    cells_[key(cx, cy)].push_back(x_.size());
+    x_.push_back(x);
+    y_.push_back(y);
+
+    if (cx_max_ < cx_min_) {
+      cx_min_ = cx_max_ = cx;
+      cy_min_ = cy_max_ = cy;
+    } else {
+      cx_min_ = std::min(cx_min_, cx);
+      cx_max_ = std::max(cx_max_, cx);
+      cy_min_ = std::min(cy_min_, cy);
+      cy_max_ = std::max(cy_max_, cy);
+    }
+  }
+
+  /**
+   * \brief The `k` keyframes of index below `end` closest to (x, y), sorted by increasing distance.
+   *
+   * Cells are visited in square rings around the query, until the k-th neighbor found
+   * is closer than any unvisited cell. A `max_distance` above 0 also limits the search.
+   */
+  void nearest(double x, double y, size_t k, size_t end, double max_distance,
+               std::vector<Neighbor>& neighbors) const {
+    neighbors.clear();
+    if (k == 0 || x_.empty())
+      return;
+
+    const double max_distance_sq = max_distance > 0 ? max_distance * max_distance : HUGE_VAL;
+    const int cx = cell(x), cy = cell(y);
+    const int rings = std::max(std::max(cx - cx_min_, cx_max_ - cx), std::max(cy - cy_min_, cy_max_ - cy));
+    for (int r = 0; r <= rings; r++) {
+      // ring cells within the occupied bounds: whole first and last columns, top and bottom cells in between
+      const int i_min = std::max(cx - r, cx_min_), i_max = std::min(cx + r, cx_max_);
+      const int j_min = std::max(cy - r, cy_min_), j_max = std::min(cy + r, cy_max_);
+      for (int i = i_min; i <= i_max; i++) {
+        if (i == cx - r || i == cx + r) {
+          for (int j = j_min; j <= j_max; j++)
+            collect(i, j, x, y, end, max_distance_sq, neighbors);
+        } else {
+          if (cy - r >= cy_min_)
+            collect(i, cy - r, x, y, end, max_distance_sq, neighbors);
+          if (cy + r <= cy_max_)
+            collect(i, cy + r, x, y, end, max_distance_sq, neighbors);
+        }
+      }
+
+      // unvisited cells are at least r cells away
+      const double reach = r * cell_size_;
+      if (neighbors.size() >= k) {
+        std::partial_sort(neighbors.begin(), neighbors.begin() + k, neighbors.end());
+        neighbors.resize(k);
+        if (neighbors.back().first <= reach * reach)
+          break;
+      }
+      if (reach * reach > max_distance_sq)
+        break;
+    }
+    std::sort(neighbors.begin(), neighbors.end());
+  }
+
+  /// The keyframes of index below `end` within `radius` of (x, y), sorted by increasing distance
+  void radius(double x, double y, double radius, size_t end, std::vector<Neighbor>& neighbors) const {
+    neighbors.clear();
+    const int i_min = std::max(cell(x - radius), cx_min_), i_max = std::min(cell(x + radius), cx_max_);
+    const int j_min = std::max(cell(y - radius), cy_min_), j_max = std::min(cell(y + radius), cy_max_);
+    for (int i = i_min; i <= i_max; i++)
+      for (int j = j_min; j <= j_max; j++)
+        collect(i, j, x, y, end, radius * radius, neighbors);
+    std::sort(neighbors.begin(), neighbors.end());
+  }
+
+private:
+  inline int cell(double v) const { return int(std::floor(v / cell_size_)); }
+  inline static boost::int64_t key(int cx, int cy) {
+    return (boost::int64_t(cx) << 32) | boost::uint32_t(cy);
+  }
+
+  /// Append the keyframes of cell (i, j) of index below `end` and within sqrt(max_distance_sq) of (x, y)
+  void collect(int i, int j, double x, double y, size_t end, double max_distance_sq,
+               std::vector<Neighbor>& neighbors) const {
+    boost::unordered_map<boost::int64_t, std::vector<size_t> >::const_iterator it = cells_.find(key(i, j));
+    if (it == cells_.end())
+      return;
+    const std::vector<size_t>& indices = it->second;
+    for (size_t n = 0; n < indices.size(); n++) {
+      const size_t index = indices[n];
+      if (index >= end)
+        break; // indices are inserted in increasing order
+      const double dx = x_[index] - x, dy = y_[index] - y;
+      const double d2 = dx * dx + dy * dy;
+      if (d2 <= max_distance_sq)
+        neighbors.push_back(Neighbor(d2, index));
+    }
+  }
+
+  double cell_size_;
+  std::vector<double> x_, y_; // position of each keyframe, by index
+  boost::unordered_map<boost::int64_t, std::vector<size_t> > cells_; // keyframe indices of each cell, increasing
+  int cx_min_, cx_max_, cy_min_, cy_max_; // bounds of the occupied cells, empty if max < min
+};
+
+}
+
+#endif
@@ -1,50 +1,164 @@
 #include <graph.hpp>
 #include "utils.hpp"
+#include "keyframe_grid.hpp"
+#include "keyframe_store.hpp"
+#include "graph_node.hpp"
 #include <common/Factor.h>
 #include <common/Graph.h>
 
+namespace {
+
 // #### TUNING CONSTANTS START
 int keyframes_to_skip_in_loop_closing;
 double sigma_xy_prior, sigma_th_prior;
+std::string solver; // "isam2": incremental, "batch": Levenberg-Marquardt over the whole graph at each loop
+double isam2_relinearize_threshold;
+double keyframe_grid_cell_size;
 
 // #### TUNING CONSTANTS END
 
 //// OK WE START HERE ////
 
 // Our own structures for holding keyframes and factors
-std::vector<common::Keyframe> keyframes; // JS: Better use map<key,Keyframe> where key = ID, as in gtsam::Values
+KeyframeStore keyframes; // poses in arrays apart from the sensor data, with lookup by ID as in gtsam::Values
 std::vector<common::Factor> factors;
 int keyframe_IDs; // Simple ID factory for keyframes.
+graph::KeyframeGrid keyframe_grid; // positions of the keyframes, by index in keyframes, for closest_keyframe()
 
-// GTSAM's structures for graph and pose values
+// GTSAM's structures for graph and pose values, for the batch solver only
 gtsam::NonlinearFactorGraph graph;
 gtsam::Values poses_initial;
-
-// ROS publisher
+size_t factor_count = 0; // factors in the problem, prior included, whatever the solver
+
+// What was added to the problem since the last incremental solver job, for iSAM2 only
+bool use_isam2;
+gtsam::NonlinearFactorGraph graph_new;
+gtsam::Values poses_new;
+
+// Solver thread: optimizes its own copy of the factor graph, so that the services
+// keep answering from the last committed poses while it runs
+struct SolverJob {
+  gtsam::NonlinearFactorGraph graph; // iSAM2: new factors; batch: the whole graph
+  gtsam::Values poses;               // iSAM2: new poses; batch: initial values of all poses
+  bool estimate;                     // compute and hand back the optimized poses
+};
+boost::scoped_ptr<gtsam::ISAM2> isam2; // owned by the solver thread
+std::deque<SolverJob> solver_jobs;
+boost::shared_ptr<const gtsam::Values> poses_solved; // last result, not yet committed
+boost::mutex solver_mutex; // guards solver_jobs, poses_solved and solver_running
+boost::condition_variable solver_condition;
+bool solver_running = false; // cleared to stop the worker
+boost::scoped_ptr<boost::thread> solver_thread;
+ros::WallTimer commit_timer;
+
+// ROS publishers
 ros::Publisher graph_pub;
+ros::Publisher graph_update_pub;
+ros::Publisher keyframe_last_pub;
+ros::Subscriber registration_sub;
+ros::ServiceServer last_keyframe_service;
+ros::ServiceServer closest_keyframe_service;
+ros::ServiceServer graph_snapshot_service;
+unsigned int keyframe_last_version = 0; // bumped each time the last keyframe changes
+unsigned int solve_version = 0; // bumped each time optimized poses are committed
+
+// Graph update stream: what was already published, and the poses changed by commit_poses() since
+unsigned int graph_version = 0; // bumped with each update
+size_t keyframes_published = 0;
+size_t factors_published = 0;
+std::vector<size_t> poses_changed; // indices in keyframes, below keyframes_published
 
 /**
- * \brief Publish the full graph for others to use.
+ * \brief Publish what changed in the graph since the last update.
+ *
+ * New keyframes and factors are sent once, in full; keyframes published before
+ * and moved by commit_poses() since are sent as pose-only updates.
  */
-void publish_graph() {
-  common::Graph output;
-  for(int i = 0; i < keyframes.size(); i++) {
-    output.keyframes.push_back(keyframes[i]);
+void publish_graph_update() {
+  common::GraphUpdatePtr output(new common::GraphUpdate);
+  output->version = ++graph_version;
+
+  keyframes.keyframes(keyframes_published, output->keyframes_new);
+  output->factors_new.assign(factors.begin() + factors_published, factors.end());
+  keyframes_published = keyframes.size();
+  factors_published = factors.size();
+
+  output->pose_ids.reserve(poses_changed.size());
+  output->poses.reserve(poses_changed.size());
+  for(size_t i = 0; i < poses_changed.size(); i++) {
+    output->pose_ids.push_back(keyframes.id(poses_changed[i]));
+    output->poses.push_back(keyframes.pose(poses_changed[i]));
   }
+  poses_changed.clear();
 
-  for(int i = 0; i < factors.size(); i++) {
-    output.factors.push_back(factors[i]);
-  }
+  graph_update_pub.publish(output);
+}
 
+/**
+ * \brief Publish the graph for others to use: the update stream, and the full graph if anyone listens to it.
+ */
+void publish_graph() {
+  publish_graph_update();
+
+  if(graph_pub.getNumSubscribers() == 0)
+    return;
+
+  common::GraphPtr output(new common::Graph);
+  keyframes.keyframes(0, output->keyframes);
+  output->factors = factors;
   graph_pub.publish(output);
 }
 
+/**
+ * \brief Publish the last keyframe, with a new version number.
+ *
+ * Called each time the last keyframe changes: when it is created, and when its
+ * pose is optimized. The topic is latched, so late subscribers get the current one.
+ */
+void publish_last_keyframe() {
+  if(keyframes.empty())
+    return;
+
+  common::KeyframeUpdatePtr output(new common::KeyframeUpdate);
+  output->version = ++keyframe_last_version;
+  output->solve_version = solve_version;
+  output->keyframe = keyframes.keyframe(keyframes.size() - 1);
+  keyframe_last_pub.publish(output);
+}
+
+/**
+ * \brief Add a factor to the structures of the solver in use.
+ *
+ * The batch solver keeps the whole graph; iSAM2 keeps only what it was not given yet.
+ */
+template <class FactorType>
+void add_factor(const FactorType& factor) {
+  if(use_isam2)
+    graph_new.add(factor);
+  else
+    graph.add(factor);
+  factor_count++;
+}
+
+/**
+ * \brief Add the initial value of a new pose to the structures of the solver in use.
+ */
+void add_pose(int id, const gtsam::Pose2& pose) {
+  if(use_isam2)
+    poses_new.insert(id, pose);
+  else
+    poses_initial.insert(id, pose);
+}
+
 /**
  * \brief Create the first keyframe with a prior factor at the origin.
  *
  * In principle, it is called just once at the arrival of the first laser-scan.
  */
-void prior_factor(common::Registration input) {
+void prior_factor(const common::Registration& input) {
+
+  // the message is shared with other subscribers: work on a copy of the new keyframe
+  common::Keyframe keyframe_new = input.keyframe_new;
 
   // Advance keyframe ID factory
   keyframe_IDs++;
@@ -64,109 +178,259 @@ void prior_factor(common::Registration input) {
   gtsam::noiseModel::Gaussian::shared_ptr noise_prior = gtsam::noiseModel::Gaussian::Covariance(Q);
 
   // Define new KF
-  input.keyframe_new.id = keyframe_IDs;
-  // input.keyframe_new.pose_odom = // TODO: get odometry pose from odometry_pose service.
-  // input.keyframe_new.pose_opti = create_Pose2DWithCovariance_msg(x_prior, y_prior, th_prior, Q); // TODO fix this
-  input.keyframe_new.pose_opti.pose.x  = x_prior;
-  input.keyframe_new.pose_opti.pose.y  = y_prior;
-  input.keyframe_new.pose_opti.pose.theta = th_prior;
-  keyframes.push_back(input.keyframe_new);
+  keyframe_new.id = keyframe_IDs;
+  // keyframe_new.pose_odom = // TODO: get odometry pose from odometry_pose service.
+  // keyframe_new.pose_opti = create_Pose2DWithCovariance_msg(x_prior, y_prior, th_prior, Q); // TODO fix this
+  keyframe_new.pose_opti.pose.x  = x_prior;
+  keyframe_new.pose_opti.pose.y  = y_prior;
+  keyframe_new.pose_opti.pose.theta = th_prior;
+  keyframes.add(keyframe_new);
+  keyframe_grid.insert(x_prior, y_prior);
 
   // Add factor and prior to the graph
-  graph.add(gtsam::PriorFactor<gtsam::Pose2>(input.keyframe_new.id, pose_prior, noise_prior));
-  poses_initial.insert(input.keyframe_new.id, pose_prior);
+  gtsam::PriorFactor<gtsam::Pose2> prior(keyframe_new.id, pose_prior, noise_prior);
+  add_factor(prior);
+  add_pose(keyframe_new.id, pose_prior);
 
   // print debug info
   ROS_INFO("PRIOR FACTOR ID=%d CREATED. %lu KF, %lu Factor, 0 loops",
-	   input.keyframe_new.id, keyframes.size(), graph.nrFactors());
+	   keyframe_new.id, keyframes.size(), factor_count);
 } 
 
 /**
  * \brief Create a new keyframe and a motion factor from the last keyframe to the new keyframe.
  */
-void motion_factor(common::Registration input) {
+void motion_factor(const common::Registration& input) {
+
+  // the message is shared with other subscribers: work on a copy of the new keyframe and factor
+  common::Keyframe keyframe_new = input.keyframe_new;
+  common::Factor factor_new = input.factor_new;
 
   // Advance keyframe ID factory
   keyframe_IDs++;
 
-  // Compute new KF pose
-  common::Pose2DWithCovariance pose_new_msg = compose(input.keyframe_last.pose_opti, input.factor_new.delta);
+  // Compute new KF pose, from the current estimate of the last KF
+  common::Pose2DWithCovariance pose_new_msg = compose(keyframes.pose_opti(keyframes.index(input.keyframe_last_id)),
+						     factor_new.delta);
   gtsam::Pose2 pose_new(pose_new_msg.pose.x, pose_new_msg.pose.y, pose_new_msg.pose.theta);
 
   // Define new KF
-  input.keyframe_new.id = keyframe_IDs;
-  input.keyframe_new.pose_opti = pose_new_msg;
-  // input.keyframe_new.pose_odom = // TODO: get odometry pose from odometry_pose service.
-  keyframes.push_back(input.keyframe_new);
+  keyframe_new.id = keyframe_IDs;
+  keyframe_new.pose_opti = pose_new_msg;
+  // keyframe_new.pose_odom = // TODO: get odometry pose from odometry_pose service.
+  keyframes.add(keyframe_new);
+  keyframe_grid.insert(pose_new_msg.pose.x, pose_new_msg.pose.y);
 
   // Define new factor
-  input.factor_new.id_2 = input.keyframe_new.id;
-  Eigen::MatrixXd Q = covariance_to_eigen(input.factor_new.delta.covariance);
+  factor_new.id_1 = input.keyframe_last_id;
+  factor_new.id_2 = keyframe_new.id;
+  Eigen::MatrixXd Q = covariance_to_eigen(factor_new.delta.covariance);
   gtsam::noiseModel::Gaussian::shared_ptr noise_delta = gtsam::noiseModel::Gaussian::Covariance(Q);
 
   // Add factor and state to the graph
-  poses_initial.insert(input.keyframe_new.id, pose_new);
-  graph.add(gtsam::BetweenFactor<gtsam::Pose2>(input.factor_new.id_1,
-					       input.factor_new.id_2,
-					       gtsam::Pose2(input.factor_new.delta.pose.x,
-							    input.factor_new.delta.pose.y,
-							    input.factor_new.delta.pose.theta),
-					       noise_delta));
-  common::Factor factor = input.factor_new;
+  gtsam::BetweenFactor<gtsam::Pose2> between(factor_new.id_1,
+					     factor_new.id_2,
+					     gtsam::Pose2(factor_new.delta.pose.x,
+							  factor_new.delta.pose.y,
+							  factor_new.delta.pose.theta),
+					     noise_delta);
+  add_pose(keyframe_new.id, pose_new);
+  add_factor(between);
+  common::Factor factor = factor_new;
   factor.loop = false;
   factors.push_back(factor);
 
   // print debug info
   ROS_INFO("MOTION FACTOR %d-->%d. %lu KFs, %lu Factors, %lu Loops",
-	   input.factor_new.id_1, input.factor_new.id_2, keyframes.size(), graph.nrFactors(), graph.nrFactors() - keyframes.size());
+	   factor_new.id_1, factor_new.id_2, keyframes.size(), factor_count, factor_count - keyframes.size());
 }
 
 /**
  * \brief Create a loop factor from the last keyframe to another keyframe.
  */
-void loop_factor(common::Registration input)
+void loop_factor(const common::Registration& input)
 {
 
-    // Define new factor
+    // Define new factor, between the keyframes referenced by the registration
+    common::Factor factor = input.factor_loop;
+    factor.id_1 = input.keyframe_last_id;
+    factor.id_2 = input.keyframe_loop_id;
+    factor.loop = true;
     Eigen::MatrixXd Q = covariance_to_eigen(input.factor_loop.delta.covariance);
     gtsam::noiseModel::Gaussian::shared_ptr noise_delta = gtsam::noiseModel::Gaussian::Covariance(Q);
 
     // Add factor to the graph
-    graph.add(gtsam::BetweenFactor<gtsam::Pose2>(input.factor_loop.id_1,
-                                                 input.factor_loop.id_2,
-                                                 gtsam::Pose2(input.factor_loop.delta.pose.x,
-                                                              input.factor_loop.delta.pose.y,
-                                                              input.factor_loop.delta.pose.theta),
-                                                 noise_delta));
-    common::Factor factor = input.factor_loop;
-    factor.loop = true;
+    gtsam::BetweenFactor<gtsam::Pose2> between(factor.id_1,
+                                               factor.id_2,
+                                               gtsam::Pose2(input.factor_loop.delta.pose.x,
+                                                            input.factor_loop.delta.pose.y,
+                                                            input.factor_loop.delta.pose.theta),
+                                               noise_delta);
+    add_factor(between);
     factors.push_back(factor);
 
     // print debug info
     ROS_INFO("LOOP FACTOR %d-->%d. %lu KFs, %lu Factors, %lu Loops",
-	     input.factor_loop.id_1, input.factor_loop.id_2, keyframes.size(), graph.nrFactors(), graph.nrFactors() - keyframes.size());
+	     factor.id_1, factor.id_2, keyframes.size(), factor_count, factor_count - keyframes.size());
+}
+
+/**
+ * \brief Hand the factors and poses created since the last call over to the solver thread.
+ *
+ * With iSAM2 they are added incrementally, and the optimized poses are computed only
+ * if `estimate` is set. The batch solver gets a copy of the whole graph, and only
+ * when `estimate` is set: a pending batch job is replaced, as only the latest matters.
+ */
+void queue_solver_job(bool estimate) {
+  SolverJob job;
+  job.estimate = estimate;
+  if(use_isam2) {
+    if(graph_new.empty() && !estimate)
+      return;
+    job.graph = graph_new;
+    job.poses = poses_new;
+    graph_new = gtsam::NonlinearFactorGraph();
+    poses_new.clear();
+  } else {
+    if(!estimate)
+      return;
+    job.graph = graph;
+    job.poses = poses_initial;
+  }
+
+  boost::mutex::scoped_lock lock(solver_mutex);
+  if(!use_isam2)
+    solver_jobs.clear();
+  solver_jobs.push_back(job);
+  solver_condition.notify_one();
+}
+
+/**
+ * \brief Add the factors and poses created since the last call to the incremental solver.
+ *
+ * Only the variables affected by the new factors are relinearized, in the solver
+ * thread. Does nothing with the batch solver, which works on the whole graph at each solve().
+ */
+void update_incremental() {
+  queue_solver_job(false);
 }
 
 /**
- * \brief Solve the problem using GTSAM, and update our own SLAM structures.
+ * \brief Solve the problem using GTSAM, in the solver thread.
+ *
+ * The optimized poses are committed to our own SLAM structures by commit_poses().
  */
 void solve() {
+  queue_solver_job(true);
+}
 
-  gtsam::Values poses_optimized = gtsam::LevenbergMarquardtOptimizer(graph, poses_initial).optimize();
+/**
+ * \brief Solver thread: runs the solver jobs as they are queued.
+ *
+ * With iSAM2 the new factors are added incrementally and the current estimate is
+ * read back; otherwise the whole graph is re-optimized with Levenberg-Marquardt.
+ * The optimized poses replace the last result, which is swapped out by commit_poses().
+ */
+void solver_worker() {
+  while(ros::ok()) {
+    SolverJob job;
+    {
+      boost::mutex::scoped_lock lock(solver_mutex);
+      while(solver_jobs.empty() && solver_running && ros::ok())
+        solver_condition.timed_wait(lock, boost::posix_time::milliseconds(100));
+      if(solver_jobs.empty() || !solver_running)
+        break;
+      job = solver_jobs.front();
+      solver_jobs.pop_front();
+    }
+
+    ros::WallTime start = ros::WallTime::now();
+    boost::shared_ptr<gtsam::Values> poses_optimized;
+    if(use_isam2) {
+      gtsam::ISAM2Result result = isam2->update(job.graph, job.poses);
+      ROS_INFO("ISAM2 UPDATE: %lu new factors, %lu relinearized, %lu reeliminated, %.3f ms",
+	       job.graph.size(), result.variablesRelinearized, result.variablesReeliminated,
+	       (ros::WallTime::now() - start).toSec() * 1e3);
+      if(!job.estimate)
+        continue;
+      isam2->update(); // a loop moves many poses: one more relinearization step before reading the estimate
+      poses_optimized.reset(new gtsam::Values(isam2->calculateEstimate()));
+    } else {
+      poses_optimized.reset(new gtsam::Values(gtsam::LevenbergMarquardtOptimizer(job.graph, job.poses).optimize()));
+    }
+
+    ROS_INFO("SOLVE FINISHED (%s): %lu poses, %.3f ms",
+	     use_isam2 ? "isam2" : "batch", poses_optimized->size(), (ros::WallTime::now() - start).toSec() * 1e3);
+
+    boost::mutex::scoped_lock lock(solver_mutex);
+    poses_solved = poses_optimized;
+  }
+}
+
+/**
+ * \brief Timer callback: commit the last poses optimized by the solver thread, if any.
+ *
+ * Keyframes created while the solver was running are not in its result: they are
+ * re-anchored, moved with the last keyframe that is. The last keyframe and the graph
+ * are then published again.
+ */
+void commit_poses(const ros::WallTimerEvent& event) {
 
+  boost::shared_ptr<const gtsam::Values> poses_optimized;
+  {
+    boost::mutex::scoped_lock lock(solver_mutex);
+    poses_optimized.swap(poses_solved);
+  }
+  if(!poses_optimized)
+    return;
 
+  const double pose_tolerance = 1e-6; // [m] and [rad]: smaller changes are not published
+  keyframe_grid.clear(); // rebuilt with the new poses
+  gtsam::Pose2 correction; // from the old to the new pose of the last optimized keyframe
+  size_t reanchored = 0;
   for(int i = 0; i < keyframes.size(); i++) {
-    keyframes[i].pose_opti.pose.x = poses_optimized.at<gtsam::Pose2>(keyframes[i].id).x();
-    keyframes[i].pose_opti.pose.y = poses_optimized.at<gtsam::Pose2>(keyframes[i].id).y();
-    keyframes[i].pose_opti.pose.theta = poses_optimized.at<gtsam::Pose2>(keyframes[i].id).theta();
-//    Eigen::MatrixXd pose_opti_covariance = marginals.marginalCovariance(keyframes[i].id);
+    const int id = keyframes.id(i);
+    gtsam::Pose2 pose_old(keyframes.x(i), keyframes.y(i), keyframes.theta(i));
+    gtsam::Pose2 pose;
+    if(poses_optimized->exists(id)) {
+      pose = poses_optimized->at<gtsam::Pose2>(id);
+      correction = pose * pose_old.inverse();
+    } else {
+      pose = correction * pose_old;
+      reanchored++;
+    }
+    if(i < keyframes_published &&
+       (fabs(pose.x() - pose_old.x()) > pose_tolerance ||
+        fabs(pose.y() - pose_old.y()) > pose_tolerance ||
+        fabs(pose.theta() - pose_old.theta()) > pose_tolerance))
+      poses_changed.push_back(i);
+    keyframes.set_pose(i, pose.x(), pose.y(), pose.theta());
+//    Eigen::MatrixXd pose_opti_covariance = marginals.marginalCovariance(id);
 //    keyframes[i].pose_opti = eigen_to_covariance(keyframes[i].pose_opti, pose_opti_covariance);
+
+    // get ready for next iteration: next initial values are the currently optimized ones
+    if(!use_isam2)
+      poses_initial.update(id, pose);
+    keyframe_grid.insert(pose.x(), pose.y());
   }
 
-  // get ready for next iteration: set next initial to the currently optimized values
-  poses_initial = poses_optimized;
+  solve_version++;
+  ROS_INFO("POSES COMMITTED: %lu KFs, %lu moved, %lu re-anchored", keyframes.size(), poses_changed.size(), reanchored);
+
+  publish_last_keyframe();
+  publish_graph();
+}
 
-  ROS_INFO("SOLVE FINISHED.");
+/**
+ * \brief Service providing the full graph, and the version of the last update it includes.
+ *
+ * For subscribers to the update stream that joined late or missed an update.
+ */
+bool graph_snapshot(common::GraphSnapshot::Request &req, common::GraphSnapshot::Response &res) {
+  res.version = graph_version;
+  keyframes.keyframes(0, res.graph.keyframes);
+  res.graph.factors = factors;
+  return true;
 }
 
 /**
@@ -175,7 +439,7 @@ void solve() {
 bool last_keyframe(common::LastKeyframe::Request &req, common::LastKeyframe::Response &res) {
 
   if(!keyframes.empty()) {
-    res.keyframe_last = keyframes.back();
+    res.keyframe_last = keyframes.keyframe(keyframes.size() - 1);
 
     return true;
   }
@@ -184,7 +448,11 @@ bool last_keyframe(common::LastKeyframe::Request &req, common::LastKeyframe::Res
 }
 
 /**
- * \brief Service providing the keyframe in the graph that is closest to a given keyframe.
+ * \brief Service providing the keyframes in the graph that are closest to a given keyframe.
+ *
+ * The `candidates` closest keyframes, within `max_distance` if set, are returned sorted
+ * by distance in `keyframes_closest`. They are looked up in the keyframe grid, without
+ * scanning all keyframes.
  *
  * The function skips from the search a number of keyframes right behind the last keyframe.
  * This is done to avoid closing loops against the near keyframe history.
@@ -192,26 +460,23 @@ bool last_keyframe(common::LastKeyframe::Request &req, common::LastKeyframe::Res
 bool closest_keyframe(common::ClosestKeyframe::Request &req, common::ClosestKeyframe::Response &res) {
 
   if(!keyframes.empty()) {
-    std::vector<double> distances;
 
     if(keyframes.size() > keyframes_to_skip_in_loop_closing) {
-      for(int i = 0; i < keyframes.size() - keyframes_to_skip_in_loop_closing; i++) {
-	double x1 = req.keyframe_last.pose_opti.pose.x;
-	double y1 = req.keyframe_last.pose_opti.pose.y;
-	double x2 = keyframes[i].pose_opti.pose.x;
-	double y2 = keyframes[i].pose_opti.pose.y;
-	distances.push_back( sqrt( pow( x2 - x1, 2 ) + pow( y2 - y1, 2 ) ) );
+      size_t n = keyframes.size() - keyframes_to_skip_in_loop_closing;
+      std::vector<graph::KeyframeGrid::Neighbor> neighbors; // (squared distance, keyframe index)
+      keyframe_grid.nearest(req.keyframe_last.pose_opti.pose.x, req.keyframe_last.pose_opti.pose.y,
+			    std::max(req.candidates, 1), n, req.max_distance, neighbors);
+
+      if(neighbors.empty()) {
+	ROS_INFO("CLOSEST KEYFRAME SERVICE FINISHED. No keyframes within %f m.", req.max_distance);
+	return false;
       }
 
-      int minimum_keyframe_index = 0;
-      for(int i = 0; i < distances.size(); i++) {
-	if(distances[i] < distances[minimum_keyframe_index]) {
-	  minimum_keyframe_index = i;
-	}
+      res.keyframes_closest.reserve(neighbors.size());
+      for(int i = 0; i < neighbors.size(); i++) {
+	res.keyframes_closest.push_back(keyframes.keyframe(neighbors[i].second));
       }
-
-      res.keyframe_closest = keyframes[minimum_keyframe_index];
-      ROS_INFO("CLOSEST KEYFRAME ID=%d SERVICE FINISHED.", keyframes[minimum_keyframe_index].id);
+      ROS_INFO("CLOSEST KEYFRAME ID=%d SERVICE FINISHED. %lu candidates.", res.keyframes_closest.front().id, neighbors.size());
       return true;
     } else {
       ROS_INFO("CLOSEST KEYFRAME SERVICE FINISHED. Not enough keyframes.");
@@ -229,20 +494,35 @@ bool closest_keyframe(common::ClosestKeyframe::Request &req, common::ClosestKeyf
  * This function analyzes the received message and decides whether to create:
  *   - a first keyframe with a prior factor
  *   - a new keyframe with a motion factor
- *   - a loop closure factor
+ *   - a loop closure factor, together with a new keyframe or on its own
  *
- * Each time a loop is created, the problem is solved.
+ * Each time a loop is created, the problem is solved in the solver thread, and
+ * the optimized poses are committed later. With the incremental solver, the other
+ * factors are also added to it as they arrive.
  *
- * In any case, the problem's graph is published for others to use.
+ * Existing keyframes are referenced by ID; registrations against unknown
+ * keyframes are dropped.
+ *
+ * In any case, the problem's graph is published for others to use, and so is the
+ * last keyframe when a new one was created.
  */
 void registration_callback(const common::Registration& input) {
 
+  if((input.keyframe_flag || input.loop_closure_flag) &&
+     (!keyframes.contains(input.keyframe_last_id) ||
+      (input.loop_closure_flag && !keyframes.contains(input.keyframe_loop_id)))) {
+      ROS_WARN("REGISTRATION DROPPED: unknown keyframe %d or %d", input.keyframe_last_id, input.keyframe_loop_id);
+      return;
+  }
+
   if(input.first_frame_flag) {
       ROS_INFO("--------------------------------------------");
       prior_factor(input);
+      update_incremental();
+      publish_last_keyframe();
       publish_graph();
       if (!keyframes.empty())
-          ROS_INFO("Global pose: %f %f %f", keyframes.back().pose_opti.pose.x,keyframes.back().pose_opti.pose.y,keyframes.back().pose_opti.pose.theta);
+          ROS_INFO("Global pose: %f %f %f", keyframes.x(keyframes.size() - 1), keyframes.y(keyframes.size() - 1), keyframes.theta(keyframes.size() - 1));
       ROS_INFO("--------------------------------------------");
   }
 
@@ -252,26 +532,35 @@ void registration_callback(const common::Registration& input) {
       if(input.loop_closure_flag) {
           loop_factor(input);
           solve();
+      } else {
+          update_incremental();
       }
 
+      publish_last_keyframe();
       publish_graph();
       ROS_INFO("Laser Delta: %f %f %f", input.factor_new.delta.pose.x, input.factor_new.delta.pose.y, input.factor_new.delta.pose.theta);
       if (!keyframes.empty())
-          ROS_INFO("Global pose: %f %f %f", keyframes.back().pose_opti.pose.x,keyframes.back().pose_opti.pose.y,keyframes.back().pose_opti.pose.theta);
+          ROS_INFO("Global pose: %f %f %f", keyframes.x(keyframes.size() - 1), keyframes.y(keyframes.size() - 1), keyframes.theta(keyframes.size() - 1));
+      ROS_INFO("--------------------------------------------");
+  }
+
+  else if(input.loop_closure_flag) { // loop closure found asynchronously, between existing keyframes
+      loop_factor(input);
+      solve();
+      publish_graph(); // the last keyframe is unchanged until commit_poses() publishes its optimized pose
       ROS_INFO("--------------------------------------------");
   }
 
 }
 
+} // namespace
+
 /**
- * \brief Main process
+ * \brief Start the graph
  *
  * This initializes all services, callbacks and publishers, and the keyframe ID factory.
  */
-int main(int argc, char** argv) {
-  ros::init(argc, argv, "graph");
-  ros::NodeHandle n;
-  
+void graph_start(ros::NodeHandle& n) {
   // Init ID factory
   keyframe_IDs = 0;
 
@@ -303,11 +592,74 @@ int main(int argc, char** argv) {
 	     keyframes_to_skip_in_loop_closing);
   }
 
+  // ### rosparam get solver ###
+  if(ros::param::has("/graph/solver")) {
+    ros::param::get("/graph/solver", solver);
+    ROS_INFO("ROSPARAM: [LOADED] /graph/solver = %s", solver.c_str());
+  } else {
+    solver = "isam2";
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /graph/solver = %s", solver.c_str());
+  }
+  if(solver != "isam2" && solver != "batch") {
+    ROS_WARN("ROSPARAM: /graph/solver = %s unknown, using batch", solver.c_str());
+    solver = "batch";
+  }
+  use_isam2 = (solver == "isam2");
+
+  // ### rosparam get isam2_relinearize_threshold ###
+  if(ros::param::has("/graph/isam2_relinearize_threshold")) {
+    ros::param::get("/graph/isam2_relinearize_threshold", isam2_relinearize_threshold);
+    ROS_INFO("ROSPARAM: [LOADED] /graph/isam2_relinearize_threshold = %f", isam2_relinearize_threshold);
+  } else {
+    isam2_relinearize_threshold = 0.01;
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /graph/isam2_relinearize_threshold = %f",
+	     isam2_relinearize_threshold);
+  }
+
+  // ### rosparam get keyframe_grid_cell_size ###
+  if(ros::param::has("/graph/keyframe_grid_cell_size")) {
+    ros::param::get("/graph/keyframe_grid_cell_size", keyframe_grid_cell_size);
+    ROS_INFO("ROSPARAM: [LOADED] /graph/keyframe_grid_cell_size = %f", keyframe_grid_cell_size);
+  } else {
+    keyframe_grid_cell_size = 2.0;
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /graph/keyframe_grid_cell_size = %f", keyframe_grid_cell_size);
+  }
+  keyframe_grid.setCellSize(keyframe_grid_cell_size);
+
+  if(use_isam2) {
+    gtsam::ISAM2Params isam2_params;
+    isam2_params.relinearizeThreshold = isam2_relinearize_threshold;
+    isam2_params.relinearizeSkip = 1;
+    isam2.reset(new gtsam::ISAM2(isam2_params));
+  }
+
   graph_pub = n.advertise<common::Graph>("/graph/graph", 1);
-  ros::Subscriber registration_sub = n.subscribe("/scanner/registration", 1, registration_callback);
-  ros::ServiceServer last_keyframe_service = n.advertiseService("/graph/last_keyframe", last_keyframe);
-  ros::ServiceServer closest_keyframe_service = n.advertiseService("/graph/closest_keyframe", closest_keyframe);
+  graph_update_pub = n.advertise<common::GraphUpdate>("/graph/graph_update", 100); // updates are not to be dropped
+  keyframe_last_pub = n.advertise<common::KeyframeUpdate>("/graph/last_keyframe_update", 1, true); // latched
+  keyframe_last_pub.publish(common::KeyframeUpdatePtr(new common::KeyframeUpdate)); // version 0: no keyframe yet
+  registration_sub = n.subscribe("/scanner/registration", 10, registration_callback);
+  last_keyframe_service = n.advertiseService("/graph/last_keyframe", last_keyframe);
+  closest_keyframe_service = n.advertiseService("/graph/closest_keyframe", closest_keyframe);
+  graph_snapshot_service = n.advertiseService("/graph/graph_snapshot", graph_snapshot);
+  commit_timer = n.createWallTimer(ros::WallDuration(0.05), commit_poses);
+
+  solver_running = true;
+  solver_thread.reset(new boost::thread(solver_worker));
+}
+
+/**
+ * \brief Stop the graph: unsubscribe, and wait for the solver thread to finish its job
+ */
+void graph_stop() {
+  registration_sub.shutdown();
+  commit_timer.stop();
 
-  ros::spin();
-  return 0;
+  {
+    boost::mutex::scoped_lock lock(solver_mutex);
+    solver_running = false;
+  }
+  solver_condition.notify_all();
+  if(solver_thread)
+    solver_thread->join();
+  solver_thread.reset();
 }
@@ -0,0 +1,15 @@
+#include "graph_node.hpp"
+
+/**
+ * \brief Main process: the graph as a standalone node
+ */
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "graph");
+  ros::NodeHandle n;
+
+  graph_start(n);
+  ros::spin();
+  graph_stop();
+
+  return 0;
+}
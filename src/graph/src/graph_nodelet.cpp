@@ -0,0 +1,27 @@
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "graph_node.hpp"
+
+namespace graph {
+
+/**
+ * \brief The graph as a nodelet.
+ *
+ * Loaded in the same manager as the scanner and markers nodelets, registration
+ * and graph messages are passed by pointer instead of being serialized.
+ */
+class GraphNodelet : public nodelet::Nodelet {
+public:
+  virtual ~GraphNodelet() { graph_stop(); }
+
+private:
+  virtual void onInit() {
+    // single-threaded handle: callbacks run one at a time, as in the standalone node
+    graph_start(getNodeHandle());
+  }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(graph::GraphNodelet, nodelet::Nodelet)
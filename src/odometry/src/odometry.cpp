@@ -1,17 +1,15 @@
 #include <math.h>
-#include <vector>
-#include <deque>
 
 #include <ros/ros.h>
-#include <ros/geometry_msgs/Twist.h>
-
-#include <geo>
+#include <geometry_msgs/Twist.h>
+#include <geometry_msgs/Pose2D.h>
 
 #include "common/Odometry.h"
 #include "common/Pose2DWithCovariance.h"
 #include "common/OdometryBuffer.h"
 
 #include "utils.hpp"
+#include "odometry_cache.hpp"
 
 
 // Tuning constants:
@@ -26,7 +24,7 @@ struct Twist2D{
 } twist;
 
 
-std::deque<common::Odometry> buffer_odom; // JS: changed vector --> deque for an efficient pop_front().
+OdometryCache buffer_odom; // time-ordered, interpolated lookups
 
 
 void vel_callback(const geometry_msgs::Twist::ConstPtr& input) {
@@ -36,47 +34,23 @@ void vel_callback(const geometry_msgs::Twist::ConstPtr& input) {
 }
 
 void add_to_buffer(const common::Odometry& input) {
-  if(buffer_odom.size() > 1000) {
-      buffer_odom.pop_front();
-  }
-
-  buffer_odom.push_back(input);
+  buffer_odom.add(input);
 }
 
-// JS: Rename and adjust API to 'between(keyframe , keyframe)' as in the document
-// JS: or, otherwise, just leave as a buffer request, in such case return only one odometry instance, not the increment between two instances.
+/**
+ * \brief Odometry motion between two instants, interpolated from the buffer.
+ *
+ * Fails if either instant is not covered by the buffer.
+ */
 bool odometry_buffer_request(common::OdometryBuffer::Request &req, common::OdometryBuffer::Response &res) {
-  int buffer_search_position = 0;
-  int t_start_buffer_position = 0;
-  int t_end_buffer_position = 0;
-  int t_start = (int) req.t_start.toSec();
-  int t_end = (int) req.t_end.toSec();
-  bool t_start_found = false;
-  bool t_end_found = false;
-  std::vector<common::Odometry> odometry_buffer_frozen = buffer_odom;
-
-  for(int i = 0; i < buffer_odom.size(); i++) {
-    buffer_search_position = (int) odometry_buffer_frozen[i].ts.toSec();
-
-    if(buffer_search_position == t_start) {
-      t_start_buffer_position = i;
-      t_start_found = true;
-    }
-
-    if(buffer_search_position == t_end) {
-      t_end_buffer_position = i;
-      t_end_found = true;
-    }
-  }
-
-  if(t_start_found && t_end_found) {
-    common::Pose2DWithCovariance t_start_pose   = odometry_buffer_frozen[t_start_buffer_position].pose;
-    common::Pose2DWithCovariance t_end_pose     = odometry_buffer_frozen[t_end_buffer_position].pose;
-    res.delta = between(t_start_pose, t_end_pose); // JS: we want one pose returned, not the pose increment
-    return true;
+  geometry_msgs::Pose2D t_start_pose, t_end_pose;
+  if(!buffer_odom.poses_between(req.t_start, req.t_end, t_start_pose, t_end_pose)) {
+    return false;
   }
 
-  return false;
+  res.delta.pose = between(t_start_pose, t_end_pose);
+  res.Delta = res.delta;
+  return true;
 }
 
 
@@ -88,7 +62,9 @@ int main(int argc, char** argv)
 
     ros::Subscriber vel_sub = n.subscribe("/cmd_vel_modified", 1, vel_callback);
 
-    ros::Publisher odom_pub = n.advertise < common::Odometry > ("/odometry/odometry", 1);
+    ros::Publisher odom_pub = n.advertise < common::Odometry > ("/odometry/odometry", 100);
+
+    ros::ServiceServer odometry_buffer_srv = n.advertiseService("/odometry/odometry_buffer", odometry_buffer_request);
 
     ros::Time current_time  = ros::Time::now();
     ros::Time last_time     = current_time;
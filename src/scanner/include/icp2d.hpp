@@ -0,0 +1,788 @@
+#ifndef ICP2D_HPP
+#define ICP2D_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <Eigen/Dense>
+
+#include <nanoflann.hpp>
+
+namespace scanner {
+
+/**
+ * \brief Planar point cloud, stored as a structure of arrays.
+ *
+ * Also implements the dataset interface required by nanoflann.
+ */
+struct PointCloud2D {
+  std::vector<float> x;
+  std::vector<float> y;
+
+  inline size_t size() const { return x.size(); }
+  inline bool empty() const { return x.empty(); }
+  inline void clear() { x.clear(); y.clear(); }
+  inline void reserve(size_t n) { x.reserve(n); y.reserve(n); }
+  inline void resize(size_t n) { x.resize(n); y.resize(n); }
+  inline void push_back(float px, float py) { x.push_back(px); y.push_back(py); }
+
+  // nanoflann dataset interface
+  inline size_t kdtree_get_point_count() const { return x.size(); }
+  inline float kdtree_distance(const float* p1, const size_t idx_p2, size_t) const {
+    const float dx = p1[0] - x[idx_p2];
+    const float dy = p1[1] - y[idx_p2];
+    return dx*dx + dy*dy;
+  }
+  inline float kdtree_get_pt(const size_t idx, int dim) const { return dim == 0 ? x[idx] : y[idx]; }
+  template <class BBOX> bool kdtree_get_bbox(BBOX&) const { return false; }
+};
+
+typedef nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Fixed_Adaptor<float, PointCloud2D, 2>,
+                                            PointCloud2D, 2, int> KDTree2D;
+
+/**
+ * \brief Registration target: a point cloud together with its search index and, optionally, its line normals.
+ *
+ * The index and the normals are computed once at construction, so a target can be
+ * shared by any number of alignments. A beam projection (see set_projection()) can be
+ * added before the target is shared.
+ */
+class Target2D : private boost::noncopyable {
+public:
+  typedef boost::shared_ptr<Target2D> Ptr;
+  typedef boost::shared_ptr<const Target2D> ConstPtr;
+
+  explicit Target2D(const PointCloud2D& cloud, bool compute_normals = false) :
+    cloud_(cloud), projection_x_(0), projection_y_(0), projection_cos_(1), projection_sin_(0),
+    projection_angle_min_(0), projection_angle_increment_(1), projection_beams_(0) {
+    if (!cloud_.empty()) {
+      index_.reset(new KDTree2D(2, cloud_, nanoflann::KDTreeSingleIndexAdaptorParams(10)));
+      index_->buildIndex();
+    }
+    if (compute_normals)
+      estimate_normals();
+  }
+
+  inline const PointCloud2D& cloud() const { return cloud_; }
+  inline size_t size() const { return cloud_.size(); }
+
+  /// Unit line normals (nx, ny) per point; (0, 0) where no line could be fitted. Empty if not computed.
+  inline bool has_normals() const { return !normal_x_.empty(); }
+  inline const std::vector<float>& normal_x() const { return normal_x_; }
+  inline const std::vector<float>& normal_y() const { return normal_y_; }
+
+  /**
+   * \brief Index of the nearest target point to (px, py), or -1 if the target is empty.
+   *
+   * Exact by default; `params.eps` > 0 gives an eps-approximate neighbour.
+   */
+  inline int nearest(float px, float py, float& dist_sq,
+                     const nanoflann::SearchParams& params = nanoflann::SearchParams()) const {
+    dist_sq = std::numeric_limits<float>::max();
+    if (!index_)
+      return -1;
+    const float query[2] = {px, py};
+    int index = -1;
+    nanoflann::KNNResultSet<float, int> result(1);
+    result.init(&index, &dist_sq);
+    index_->findNeighbors(result, query, params);
+    return index;
+  }
+
+  /**
+   * \brief Index the points by the beam they fall in, for a sensor at (origin_x, origin_y, origin_th).
+   *
+   * The beams are those of the scan the target comes from: `beams` beams from `angle_min`,
+   * `angle_increment` apart. Enables nearest_projective().
+   */
+  void set_projection(float origin_x, float origin_y, float origin_th,
+                      float angle_min, float angle_increment, size_t beams) {
+    projection_x_ = origin_x;
+    projection_y_ = origin_y;
+    projection_cos_ = std::cos(origin_th);
+    projection_sin_ = std::sin(origin_th);
+    projection_angle_min_ = angle_min;
+    projection_angle_increment_ = angle_increment;
+    projection_beams_ = static_cast<int>(beams);
+
+    // points sorted by beam, with the first point of each beam
+    const size_t n = cloud_.size();
+    std::vector<int> beam(n);
+    beam_start_.assign(beams + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+      beam[i] = beam_of(cloud_.x[i], cloud_.y[i]);
+      if (beam[i] >= 0)
+        beam_start_[beam[i] + 1]++;
+    }
+    for (size_t b = 0; b < beams; b++)
+      beam_start_[b + 1] += beam_start_[b];
+    beam_points_.resize(beam_start_[beams]);
+    std::vector<int> cursor(beam_start_.begin(), beam_start_.end() - 1);
+    for (size_t i = 0; i < n; i++)
+      if (beam[i] >= 0)
+        beam_points_[cursor[beam[i]]++] = static_cast<int>(i);
+  }
+
+  inline bool has_projection() const { return !beam_start_.empty(); }
+
+  /**
+   * \brief Nearest target point to (px, py) among the beams within `window` of the one (px, py) projects to.
+   *
+   * O(window) per query. Returns -1 if those beams hold no point, or if there is no projection.
+   */
+  inline int nearest_projective(float px, float py, int window, float& dist_sq) const {
+    dist_sq = std::numeric_limits<float>::max();
+    if (!has_projection())
+      return -1;
+    const int beam = beam_of(px, py);
+    if (beam < 0)
+      return -1;
+
+    int index = -1;
+    const int first = std::max(beam - window, 0);
+    const int last = std::min(beam + window, projection_beams_ - 1);
+    for (int k = beam_start_[first]; k < beam_start_[last + 1]; k++) {
+      const int j = beam_points_[k];
+      const float dx = cloud_.x[j] - px, dy = cloud_.y[j] - py;
+      const float d = dx * dx + dy * dy;
+      if (d < dist_sq) {
+        dist_sq = d;
+        index = j;
+      }
+    }
+    return index;
+  }
+
+private:
+  /**
+   * \brief Beam that (px, py) projects to, or -1 outside the field of view
+   */
+  inline int beam_of(float px, float py) const {
+    const float dx = px - projection_x_, dy = py - projection_y_;
+    const float sx = projection_cos_ * dx + projection_sin_ * dy; // in the sensor frame
+    const float sy = projection_cos_ * dy - projection_sin_ * dx;
+    const int beam = static_cast<int>(std::floor((std::atan2(sy, sx) - projection_angle_min_) / projection_angle_increment_ + 0.5f));
+    return (beam >= 0 && beam < projection_beams_) ? beam : -1;
+  }
+
+  /**
+   * \brief Normal of the line fitted to the nearest neighbours of each point
+   */
+  void estimate_normals(size_t neighbours = 5) {
+    const size_t n = cloud_.size();
+    normal_x_.assign(n, 0.f);
+    normal_y_.assign(n, 0.f);
+    if (n < 3)
+      return;
+
+    neighbours = std::min(neighbours, n);
+    std::vector<int> indices(neighbours);
+    std::vector<float> dists_sq(neighbours);
+    for (size_t i = 0; i < n; i++) {
+      const float query[2] = {cloud_.x[i], cloud_.y[i]};
+      nanoflann::KNNResultSet<float, int> result(neighbours);
+      result.init(&indices[0], &dists_sq[0]);
+      index_->findNeighbors(result, query, nanoflann::SearchParams());
+
+      // covariance of the neighbourhood
+      double mx = 0, my = 0;
+      for (size_t k = 0; k < neighbours; k++) {
+        mx += cloud_.x[indices[k]];
+        my += cloud_.y[indices[k]];
+      }
+      mx /= neighbours; my /= neighbours;
+      double cxx = 0, cxy = 0, cyy = 0;
+      for (size_t k = 0; k < neighbours; k++) {
+        const double dx = cloud_.x[indices[k]] - mx, dy = cloud_.y[indices[k]] - my;
+        cxx += dx * dx; cxy += dx * dy; cyy += dy * dy;
+      }
+      if (cxx + cyy <= 0)
+        continue;
+
+      // the normal is orthogonal to the principal axis
+      const double phi = 0.5 * std::atan2(2 * cxy, cxx - cyy);
+      normal_x_[i] = -std::sin(phi);
+      normal_y_[i] = std::cos(phi);
+    }
+  }
+
+  PointCloud2D cloud_; // must be declared before index_, which refers to it
+  boost::scoped_ptr<KDTree2D> index_;
+  std::vector<float> normal_x_, normal_y_;
+
+  // beam projection: sensor pose and beams, and the points of each beam
+  float projection_x_, projection_y_, projection_cos_, projection_sin_;
+  float projection_angle_min_, projection_angle_increment_;
+  int projection_beams_;
+  std::vector<int> beam_start_; // points of beam b are beam_points_[beam_start_[b] .. beam_start_[b+1]-1]
+  std::vector<int> beam_points_;
+};
+
+/**
+ * \brief Convergence states, with the same values as pcl::registration::DefaultConvergenceCriteria
+ */
+enum ConvergenceState2D {
+  CONVERGENCE_2D_NOT_CONVERGED = 0,
+  CONVERGENCE_2D_ITERATIONS,
+  CONVERGENCE_2D_TRANSFORM,
+  CONVERGENCE_2D_ABS_MSE,
+  CONVERGENCE_2D_REL_MSE,
+  CONVERGENCE_2D_NO_CORRESPONDENCES
+};
+
+/**
+ * \brief How correspondences are searched
+ */
+enum CorrespondenceStrategy2D {
+  CORRESPONDENCES_2D_KDTREE = 0, // nearest target point
+  CORRESPONDENCES_2D_PROJECTIVE  // nearest target point in the neighbouring beams, for small motions
+};
+
+/**
+ * \brief Coarse level of a registration pyramid: source decimation and ICP settings
+ */
+struct PyramidLevel2D {
+  size_t stride;                      // keep one source point in `stride`
+  double max_correspondence_distance; // usually wider than at full resolution
+  int max_iterations;
+
+  PyramidLevel2D(size_t stride_ = 1, double max_correspondence_distance_ = 1.0, int max_iterations_ = 10) :
+    stride(stride_), max_correspondence_distance(max_correspondence_distance_), max_iterations(max_iterations_) {}
+};
+
+/**
+ * \brief Planar ICP, point-to-point or point-to-line.
+ *
+ * Estimates only x, y and theta, with transforms held as 3x3 homogeneous matrices.
+ * Point-to-line uses the target's line normals, and falls back to point-to-point
+ * when the target has none.
+ * The interface and the convergence criteria mirror pcl::IterativeClosestPoint,
+ * so it can be used as a drop-in replacement for planar scans.
+ *
+ * With a pyramid set, the source is first aligned decimated and with wide gates,
+ * coarsest level first, and each level starts from the previous one's result;
+ * the last level is always the full-resolution source with the regular settings.
+ *
+ * With a search epsilon set, the first iterations of each level search approximate
+ * nearest neighbours, and convergence is only accepted on exact ones.
+ */
+class ICP2D {
+public:
+  ICP2D() :
+    max_iterations_(10),
+    max_correspondence_distance_(std::sqrt(std::numeric_limits<double>::max())),
+    transformation_epsilon_(0.0),
+    rotation_epsilon_(0.99999),
+    euclidean_fitness_epsilon_(-std::numeric_limits<double>::max()),
+    mse_absolute_epsilon_(1e-12),
+    max_iterations_similar_transforms_(0),
+    use_reciprocal_correspondences_(false),
+    point_to_line_(false),
+    correspondence_strategy_(CORRESPONDENCES_2D_KDTREE),
+    projective_window_(5),
+    search_epsilon_(0),
+    exact_iterations_(2),
+    measure_search_savings_(false),
+    source_(NULL),
+    converged_(false),
+    convergence_state_(CONVERGENCE_2D_NOT_CONVERGED),
+    iterations_(0),
+    search_visits_(0),
+    approximate_queries_(0),
+    reference_queries_(0),
+    reference_saved_(0) {
+    final_transformation_.setIdentity();
+    reset_statistics();
+  }
+
+  // Parameters
+  inline void setMaximumIterations(int n) { max_iterations_ = n; }
+  inline int getMaximumIterations() const { return max_iterations_; }
+  inline void setMaxCorrespondenceDistance(double d) { max_correspondence_distance_ = d; }
+  inline double getMaxCorrespondenceDistance() const { return max_correspondence_distance_; }
+  /// Threshold on the squared translation of an iteration increment
+  inline void setTransformationEpsilon(double e) { transformation_epsilon_ = e; }
+  inline double getTransformationEpsilon() const { return transformation_epsilon_; }
+  /// Threshold on the cosine of the rotation of an iteration increment
+  inline void setRotationEpsilon(double e) { rotation_epsilon_ = e; }
+  inline double getRotationEpsilon() const { return rotation_epsilon_; }
+  /// Threshold on the relative change of the correspondences MSE
+  inline void setEuclideanFitnessEpsilon(double e) { euclidean_fitness_epsilon_ = e; }
+  inline double getEuclideanFitnessEpsilon() const { return euclidean_fitness_epsilon_; }
+  inline void setMaximumIterationsSimilarTransforms(int n) { max_iterations_similar_transforms_ = n; }
+  inline int getMaximumIterationsSimilarTransforms() const { return max_iterations_similar_transforms_; }
+  /// Keep at most one source point per target point: the closest one
+  inline void setUseReciprocalCorrespondences(bool b) { use_reciprocal_correspondences_ = b; }
+  inline bool getUseReciprocalCorrespondences() const { return use_reciprocal_correspondences_; }
+  /// Minimise point-to-line instead of point-to-point distances
+  inline void setPointToLine(bool b) { point_to_line_ = b; }
+  inline bool getPointToLine() const { return point_to_line_; }
+  /// Projective search needs a target with a projection; other targets are searched with their KD-tree
+  inline void setCorrespondenceStrategy(CorrespondenceStrategy2D strategy) { correspondence_strategy_ = strategy; }
+  inline CorrespondenceStrategy2D getCorrespondenceStrategy() const { return correspondence_strategy_; }
+  /// Beams searched on each side of the projected beam, in projective mode
+  inline void setProjectiveWindow(int beams) { projective_window_ = beams; }
+  inline int getProjectiveWindow() const { return projective_window_; }
+  /// Coarse levels run before the full-resolution alignment, coarsest first; empty for a single level
+  inline void setPyramid(const std::vector<PyramidLevel2D>& levels) { pyramid_ = levels; }
+  inline const std::vector<PyramidLevel2D>& getPyramid() const { return pyramid_; }
+
+  /// KD-tree search epsilon of the first iteration of each level, halved at each iteration (0: exact search)
+  inline void setSearchEpsilon(float eps) { search_epsilon_ = eps; }
+  inline float getSearchEpsilon() const { return search_epsilon_; }
+  /// Last iterations of each level that always search exactly
+  inline void setExactIterations(int n) { exact_iterations_ = n; }
+  inline int getExactIterations() const { return exact_iterations_; }
+  /// Debug: repeat one approximate search in 16 exactly, to measure the node visits saved (getSearchVisitsSaved())
+  inline void setMeasureSearchSavings(bool b) { measure_search_savings_ = b; }
+  inline bool getMeasureSearchSavings() const { return measure_search_savings_; }
+
+  // Inputs
+  inline void setInputSource(const PointCloud2D& source) { source_ = &source; }
+  inline void setInputTarget(const Target2D::ConstPtr& target) { target_ = target; }
+  inline const Target2D::ConstPtr& getInputTarget() const { return target_; }
+
+  // Outputs
+  inline bool hasConverged() const { return converged_; }
+  inline ConvergenceState2D getConvergenceState() const { return convergence_state_; }
+  inline const Eigen::Matrix3f& getFinalTransformation() const { return final_transformation_; }
+  /// Total iterations of the last alignment, over all levels
+  inline int getIterations() const { return iterations_; }
+  /// Iterations of each level of the last alignment, coarsest first and full resolution last
+  inline const std::vector<int>& getLevelIterations() const { return level_iterations_; }
+  /// Wall time in seconds of each level of the last alignment, same order
+  inline const std::vector<double>& getLevelTimes() const { return level_times_; }
+  /// KD-tree nodes visited by the correspondence searches of the last alignment
+  inline size_t getSearchVisits() const { return search_visits_; }
+  /// KD-tree node visits saved by the approximate searches of the last alignment (estimate, 0 unless measured)
+  inline double getSearchVisitsSaved() const {
+    return reference_queries_ > 0 ? reference_saved_ * approximate_queries_ / reference_queries_ : 0.0;
+  }
+
+  /**
+   * \brief Mean squared distance from the source points to their nearest target points.
+   *
+   * Same definition as pcl::Registration::getFitnessScore(): all source points, no
+   * distance gate. Taken from the nearest-neighbour queries of the last iteration,
+   * so it costs no extra search, except in projective mode where they are repeated exactly.
+   */
+  inline double getFitnessScore() const { return fitness_; }
+  /// Fraction of the source points with a correspondence in the last iteration
+  inline double getInlierRatio() const { return inlier_ratio_; }
+  /// Mean squared distance over the correspondences of the last iteration
+  inline double getCorrespondencesMSE() const { return correspondences_mse_; }
+  /// Number of correspondences of the last iteration
+  inline size_t getCorrespondences() const { return correspondences_; }
+
+  /**
+   * \brief Align the source to the target, starting from `guess`
+   */
+  void align(const Eigen::Matrix3f& guess) {
+    final_transformation_ = guess;
+    converged_ = false;
+    convergence_state_ = CONVERGENCE_2D_NOT_CONVERGED;
+    iterations_ = 0;
+    level_iterations_.clear();
+    level_times_.clear();
+    search_visits_ = 0;
+    approximate_queries_ = 0;
+    reference_queries_ = 0;
+    reference_saved_ = 0;
+    reset_statistics();
+
+    if (!source_ || !target_ || source_->empty() || target_->size() == 0) {
+      convergence_state_ = CONVERGENCE_2D_NO_CORRESPONDENCES;
+      return;
+    }
+
+    // coarse levels: a level that fails leaves the estimate as it was
+    for (size_t l = 0; l < pyramid_.size(); l++) {
+      const PyramidLevel2D& level = pyramid_[l];
+      const size_t stride = std::max<size_t>(level.stride, 1);
+      level_source_.clear();
+      level_source_.reserve(source_->size() / stride + 1);
+      for (size_t i = 0; i < source_->size(); i += stride)
+        level_source_.push_back(source_->x[i], source_->y[i]);
+
+      const Eigen::Matrix3f estimate = final_transformation_;
+      align_level(level_source_, level.max_correspondence_distance, level.max_iterations);
+      if (!converged_)
+        final_transformation_ = estimate;
+    }
+
+    // full resolution
+    align_level(*source_, max_correspondence_distance_, max_iterations_);
+
+    // projective matches are the nearest points of a few beams only: the statistics of the
+    // last iteration are taken again from exact nearest neighbours, as in the other modes
+    if (use_projection() && !src_x_.empty()) {
+      const float max_dist_sq = static_cast<float>(max_correspondence_distance_ * max_correspondence_distance_);
+      find_correspondences(max_dist_sq, 0, false);
+      update_statistics();
+    }
+  }
+
+private:
+  /**
+   * \brief ICP iterations of one level, from the current estimate in final_transformation_
+   */
+  void align_level(const PointCloud2D& source, double max_correspondence_distance, int max_iterations) {
+    const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    const int iterations_before = iterations_;
+    converged_ = false;
+    convergence_state_ = CONVERGENCE_2D_NOT_CONVERGED;
+
+    const size_t n = source.size();
+    const float max_dist_sq = static_cast<float>(max_correspondence_distance * max_correspondence_distance);
+
+    src_x_.resize(n);
+    src_y_.resize(n);
+    match_.resize(n);
+    match_dist_sq_.resize(n);
+
+    double mse_previous = std::numeric_limits<double>::max();
+    int iterations_similar = 0;
+    bool exact = search_epsilon_ <= 0;
+
+    while (!converged_) {
+      // transform the source with the current estimate
+      const float c = final_transformation_(0, 0), s = final_transformation_(1, 0);
+      const float tx = final_transformation_(0, 2), ty = final_transformation_(1, 2);
+      for (size_t i = 0; i < n; i++) {
+        src_x_[i] = c * source.x[i] - s * source.y[i] + tx;
+        src_y_[i] = s * source.x[i] + c * source.y[i] + ty;
+      }
+
+      // correspondences, approximate in the first iterations: epsilon halved at each one, and
+      // exact once negligible or in the last iterations
+      const float eps = exact ? 0 : nanoflann::scheduled_eps(search_epsilon_, iterations_ - iterations_before,
+                                                             max_iterations, exact_iterations_);
+      if (eps == 0)
+        exact = true;
+      const size_t correspondences = find_correspondences(max_dist_sq, eps, use_projection());
+      update_statistics();
+      if (correspondences < 3) {
+        convergence_state_ = CONVERGENCE_2D_NO_CORRESPONDENCES;
+        converged_ = false;
+        break;
+      }
+
+      // closed-form increment and its composition with the current estimate
+      Eigen::Matrix3f delta = (point_to_line_ && target_->has_normals()) ?
+                              estimate_increment_point_to_line() : estimate_increment();
+      final_transformation_ = delta * final_transformation_;
+      iterations_++;
+
+      // convergence criteria
+      if (iterations_ - iterations_before >= max_iterations) {
+        convergence_state_ = CONVERGENCE_2D_ITERATIONS;
+        converged_ = true;
+        break;
+      }
+
+      bool is_similar = false;
+      const double cos_angle = delta(0, 0);
+      const double translation_sqr = delta(0, 2) * delta(0, 2) + delta(1, 2) * delta(1, 2);
+      if (cos_angle >= rotation_epsilon_ && translation_sqr <= transformation_epsilon_) {
+        if (iterations_similar >= max_iterations_similar_transforms_ && exact) {
+          convergence_state_ = CONVERGENCE_2D_TRANSFORM;
+          converged_ = true;
+          break;
+        }
+        is_similar = true;
+      }
+
+      const double mse = correspondences_mse_;
+
+      if (std::fabs(mse - mse_previous) < mse_absolute_epsilon_) {
+        if (iterations_similar >= max_iterations_similar_transforms_ && exact) {
+          convergence_state_ = CONVERGENCE_2D_ABS_MSE;
+          converged_ = true;
+          break;
+        }
+        is_similar = true;
+      }
+
+      if (std::fabs(mse - mse_previous) / mse_previous < euclidean_fitness_epsilon_) {
+        if (iterations_similar >= max_iterations_similar_transforms_ && exact) {
+          convergence_state_ = CONVERGENCE_2D_REL_MSE;
+          converged_ = true;
+          break;
+        }
+        is_similar = true;
+      }
+
+      // converged on approximate correspondences: confirm with exact ones
+      if (is_similar && iterations_similar >= max_iterations_similar_transforms_)
+        exact = true;
+
+      iterations_similar = is_similar ? iterations_similar + 1 : 0;
+      mse_previous = mse;
+    }
+
+    level_iterations_.push_back(iterations_ - iterations_before);
+    level_times_.push_back((boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() * 1e-6);
+  }
+
+  void reset_statistics() {
+    fitness_ = std::numeric_limits<double>::max();
+    correspondences_mse_ = std::numeric_limits<double>::max();
+    inlier_ratio_ = 0;
+    correspondences_ = 0;
+  }
+
+  /**
+   * \brief Residual statistics of the current correspondences.
+   *
+   * match_dist_sq_ holds the ungated nearest-neighbour distances, which give the fitness score.
+   * In projective mode they are only exact after align() searched them again.
+   */
+  void update_statistics() {
+    const size_t n = match_.size();
+    double sum = 0, sum_matched = 0;
+    size_t matched = 0;
+    for (size_t i = 0; i < n; i++) {
+      sum += match_dist_sq_[i];
+      if (match_[i] >= 0) {
+        sum_matched += match_dist_sq_[i];
+        matched++;
+      }
+    }
+
+    fitness_ = n > 0 ? sum / n : std::numeric_limits<double>::max();
+    correspondences_mse_ = matched > 0 ? sum_matched / matched : std::numeric_limits<double>::max();
+    inlier_ratio_ = n > 0 ? double(matched) / n : 0;
+    correspondences_ = matched;
+  }
+
+  /// True if correspondences are searched in the beams of the target
+  inline bool use_projection() const {
+    return correspondence_strategy_ == CORRESPONDENCES_2D_PROJECTIVE && target_->has_projection();
+  }
+
+  /**
+   * \brief Nearest target point of every transformed source point, gated by distance.
+   *
+   * In `projective` mode, points whose neighbouring beams are empty fall back to the KD-tree.
+   * KD-tree searches are eps-approximate for eps > 0; if the savings are measured, one in
+   * nanoflann::search_reference_stride is then repeated exactly, to count the node visits saved.
+   * Unmatched source points get match_[i] = -1. Returns the number of correspondences.
+   */
+  size_t find_correspondences(float max_dist_sq, float eps, bool projective) {
+    const size_t n = src_x_.size();
+    size_t correspondences = 0;
+    size_t approximate_queries = 0;
+
+    for (size_t i = 0; i < n; i++) {
+      float dist_sq;
+      int j = projective ? target_->nearest_projective(src_x_[i], src_y_[i], projective_window_, dist_sq) : -1;
+      if (j < 0) {
+        size_t visits = 0;
+        j = target_->nearest(src_x_[i], src_y_[i], dist_sq, nanoflann::SearchParams(32, eps, true, &visits));
+        search_visits_ += visits;
+        if (measure_search_savings_ && eps > 0 && approximate_queries++ % nanoflann::search_reference_stride == 0) {
+          size_t exact_visits = 0;
+          float exact_dist_sq;
+          target_->nearest(src_x_[i], src_y_[i], exact_dist_sq, nanoflann::SearchParams(32, 0, true, &exact_visits));
+          reference_queries_++;
+          reference_saved_ += double(exact_visits) - double(visits);
+        }
+      }
+      match_dist_sq_[i] = dist_sq;
+      match_[i] = (j >= 0 && dist_sq <= max_dist_sq) ? j : -1;
+    }
+
+    if (use_reciprocal_correspondences_) {
+      // keep only the closest source point of each target point
+      best_source_.assign(target_->size(), -1);
+      for (size_t i = 0; i < n; i++) {
+        int j = match_[i];
+        if (j < 0)
+          continue;
+        int& best = best_source_[j];
+        if (best < 0 || match_dist_sq_[i] < match_dist_sq_[best]) {
+          if (best >= 0)
+            match_[best] = -1;
+          best = static_cast<int>(i);
+        } else {
+          match_[i] = -1;
+        }
+      }
+    }
+
+    for (size_t i = 0; i < n; i++)
+      if (match_[i] >= 0)
+        correspondences++;
+
+    approximate_queries_ += approximate_queries;
+    return correspondences;
+  }
+
+  /**
+   * \brief Closed-form rigid motion that best maps the matched source points onto their targets
+   */
+  Eigen::Matrix3f estimate_increment() const {
+    const PointCloud2D& target = target_->cloud();
+    const size_t n = src_x_.size();
+
+    // centroids
+    double sx = 0, sy = 0, qx = 0, qy = 0;
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+      int j = match_[i];
+      if (j < 0)
+        continue;
+      sx += src_x_[i];
+      sy += src_y_[i];
+      qx += target.x[j];
+      qy += target.y[j];
+      count++;
+    }
+    sx /= count; sy /= count; qx /= count; qy /= count;
+
+    // cross-covariance terms
+    double sxx = 0, sxy = 0, syx = 0, syy = 0;
+    for (size_t i = 0; i < n; i++) {
+      int j = match_[i];
+      if (j < 0)
+        continue;
+      const double px = src_x_[i] - sx, py = src_y_[i] - sy;
+      const double rx = target.x[j] - qx, ry = target.y[j] - qy;
+      sxx += px * rx;
+      sxy += px * ry;
+      syx += py * rx;
+      syy += py * ry;
+    }
+
+    const double th = std::atan2(sxy - syx, sxx + syy);
+    const double c = std::cos(th), s = std::sin(th);
+
+    Eigen::Matrix3f delta;
+    delta << c, -s, qx - (c * sx - s * sy),
+             s,  c, qy - (s * sx + c * sy),
+             0,  0, 1;
+    return delta;
+  }
+
+  /**
+   * \brief Gauss-Newton step that minimises the distances from the matched source points to their target lines
+   */
+  Eigen::Matrix3f estimate_increment_point_to_line() const {
+    const PointCloud2D& target = target_->cloud();
+    const std::vector<float>& nx = target_->normal_x();
+    const std::vector<float>& ny = target_->normal_y();
+    const size_t n = src_x_.size();
+
+    // normal equations in (tx, ty, th)
+    Eigen::Matrix3d JtJ = Eigen::Matrix3d::Zero();
+    Eigen::Vector3d Jtr = Eigen::Vector3d::Zero();
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+      int j = match_[i];
+      if (j < 0 || (nx[j] == 0 && ny[j] == 0))
+        continue;
+      const double px = src_x_[i], py = src_y_[i];
+      const double r = nx[j] * (px - target.x[j]) + ny[j] * (py - target.y[j]);
+      const Eigen::Vector3d J(nx[j], ny[j], ny[j] * px - nx[j] * py);
+      JtJ.selfadjointView<Eigen::Upper>().rankUpdate(J);
+      Jtr += J * r;
+      count++;
+    }
+
+    if (count < 3)
+      return estimate_increment();
+
+    JtJ = JtJ.selfadjointView<Eigen::Upper>();
+    JtJ.diagonal().array() += 1e-9; // keeps degenerate geometries (e.g. corridors) solvable
+    const Eigen::Vector3d x = -JtJ.ldlt().solve(Jtr);
+
+    const double c = std::cos(x(2)), s = std::sin(x(2));
+    Eigen::Matrix3f delta;
+    delta << c, -s, x(0),
+             s,  c, x(1),
+             0,  0, 1;
+    return delta;
+  }
+
+  // parameters
+  int max_iterations_;
+  double max_correspondence_distance_;
+  double transformation_epsilon_;
+  double rotation_epsilon_;
+  double euclidean_fitness_epsilon_;
+  double mse_absolute_epsilon_;
+  int max_iterations_similar_transforms_;
+  bool use_reciprocal_correspondences_;
+  bool point_to_line_;
+  CorrespondenceStrategy2D correspondence_strategy_;
+  int projective_window_;
+  float search_epsilon_;
+  int exact_iterations_;
+  bool measure_search_savings_;
+
+  // inputs
+  const PointCloud2D* source_;
+  Target2D::ConstPtr target_;
+
+  // outputs
+  bool converged_;
+  ConvergenceState2D convergence_state_;
+  Eigen::Matrix3f final_transformation_;
+  int iterations_;
+  std::vector<PyramidLevel2D> pyramid_;
+  std::vector<int> level_iterations_;
+  std::vector<double> level_times_;
+
+  // KD-tree search cost of the last alignment
+  size_t search_visits_;
+  size_t approximate_queries_;
+  size_t reference_queries_; // approximate searches repeated exactly
+  double reference_saved_;   // node visits they saved over their exact repetition
+
+  // residual statistics of the last iteration
+  double fitness_;
+  double correspondences_mse_;
+  double inlier_ratio_;
+  size_t correspondences_;
+
+  // working buffers, reused across alignments
+  PointCloud2D level_source_;
+  std::vector<float> src_x_, src_y_;
+  std::vector<int> match_;
+  std::vector<float> match_dist_sq_;
+  std::vector<int> best_source_;
+};
+
+/**
+ * \brief Embed a planar transform into a 3D matrix transform
+ */
+inline Eigen::Matrix4f se2_to_matrix4(const Eigen::Matrix3f& T) {
+  Eigen::Matrix4f output(Eigen::Matrix4f::Identity());
+  output.topLeftCorner<2, 2>() = T.topLeftCorner<2, 2>();
+  output.block<2, 1>(0, 3) = T.block<2, 1>(0, 2);
+  return output;
+}
+
+/**
+ * \brief Extract the planar part (x, y, yaw) of a 3D matrix transform
+ */
+inline Eigen::Matrix3f matrix4_to_se2(const Eigen::Matrix4f& T) {
+  const float th = std::atan2(T(1, 0), T(0, 0));
+  Eigen::Matrix3f output(Eigen::Matrix3f::Identity());
+  output(0, 0) = std::cos(th); output(0, 1) = -std::sin(th);
+  output(1, 0) = std::sin(th); output(1, 1) = std::cos(th);
+  output(0, 2) = T(0, 3);
+  output(1, 2) = T(1, 3);
+  return output;
+}
+
+}
+
+#endif
@@ -18,7 +18,10 @@
 #include <common/Registration.h>
 #include <common/Pose2DWithCovariance.h>
 #include <common/LastKeyframe.h>
+#include <common/KeyframeUpdate.h>
 #include <common/ClosestKeyframe.h>
+#include <common/Odometry.h>
+#include <common/OdometryBuffer.h>
 
 #include <pcl/io/pcd_io.h>
 #include <pcl/conversions.h>
@@ -29,6 +32,10 @@
 #include <pcl/registration/gicp.h>
 #include <pcl_conversions/pcl_conversions.h>
 
+#include "beam_geometry.hpp"
+#include "icp2d.hpp"
+#include "voxel_filter2d.hpp"
+
 namespace scanner {
 
 /**
@@ -57,12 +64,69 @@ pcl::PointCloud<pcl::PointXYZ>::Ptr format_pointcloud(sensor_msgs::PointCloud2 i
   return output;
 }
 
+/**
+ * \brief convert ROS LaserScan message directly to a planar point cloud
+ *
+ * Ranges outside [range_min, range_max) are skipped, as by laser_geometry: no-return
+ * beams are reported at range_max. The output buffer is
+ * cleared but keeps its capacity, so it can be reused from scan to scan.
+ */
+void scan_to_points(const sensor_msgs::LaserScan& input, PointCloud2D& output) {
+
+  const size_t n = input.ranges.size();
+  output.resize(n);
+  if (n == 0)
+    return;
+
+  // project all beams with the cached unit vectors
+  BeamGeometry::ConstPtr beams = beam_geometry(input);
+  project_beams(*beams, &input.ranges[0], &output.x[0], &output.y[0]);
+
+  // then keep the valid ones
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++) {
+    const float range = input.ranges[i];
+    if (!(range >= input.range_min && range < input.range_max)) // also rejects NaN, and no-return beams at range_max
+      continue;
+    output.x[k] = output.x[i];
+    output.y[k] = output.y[i];
+    k++;
+  }
+  output.resize(k);
+}
+
+/**
+ * \brief convert ROS LaserScan message to a downsampled planar point cloud
+ *
+ * `raw` receives all the valid points, `output` what the filter keeps of them.
+ */
+void scan_to_points(const sensor_msgs::LaserScan& input, VoxelFilter2D& filter, PointCloud2D& raw, PointCloud2D& output) {
+
+  scan_to_points(input, raw);
+  filter.filter(raw, output);
+}
+
+/**
+ * \brief convert ROS pointcloud to planar point cloud, dropping z
+ */
+void format_pointcloud(const sensor_msgs::PointCloud2& input, PointCloud2D& output) {
+
+  pcl::PointCloud<pcl::PointXYZ>::Ptr pointcloud = format_pointcloud(input);
+
+  output.clear();
+  output.reserve(pointcloud->size());
+  for (size_t i = 0; i < pointcloud->size(); i++)
+    output.push_back(pointcloud->points[i].x, pointcloud->points[i].y);
+}
+
 /**
  * \brief Alignement output
  */
 struct Alignement{
         bool converged;
-        float fitness;
+        float fitness;          // mean squared distance to the nearest target points, all points
+        float inlier_ratio;     // fraction of points with a correspondence
+        float rmse;             // root mean squared distance over the correspondences
         pcl::registration::DefaultConvergenceCriteria<float>::ConvergenceState convergence_state;
         Eigen::Matrix4f transform;
         common::Pose2DWithCovariance Delta;
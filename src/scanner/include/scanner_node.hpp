@@ -0,0 +1,20 @@
+#ifndef SCANNER_NODE_HPP
+#define SCANNER_NODE_HPP
+
+#include <ros/ros.h>
+
+/**
+ * \brief Start the scanner on the node handle `n`: parameters, publishers, subscribers
+ * and loop closure worker.
+ *
+ * Shared by the standalone node and the nodelet. The scanner state is process-wide:
+ * one scanner per process.
+ */
+void scanner_start(ros::NodeHandle& n);
+
+/**
+ * \brief Stop the scanner started by scanner_start()
+ */
+void scanner_stop();
+
+#endif
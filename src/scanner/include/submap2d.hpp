@@ -0,0 +1,111 @@
+#ifndef SUBMAP2D_HPP
+#define SUBMAP2D_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+
+#include "icp2d.hpp"
+
+namespace scanner {
+
+/**
+ * \brief Local map made of the points of the last keyframes, in the world frame.
+ *
+ * Keyframes are appended as they are created, with their points transformed by
+ * the keyframe pose; the oldest ones are dropped beyond `max_keyframes`. The
+ * merged cloud is indexed once per change, and its registration target is shared
+ * until the next one, so tracking queries never rebuild anything.
+ */
+class Submap2D {
+public:
+  explicit Submap2D(size_t max_keyframes = 1, bool compute_normals = false) :
+    max_keyframes_(max_keyframes), compute_normals_(compute_normals),
+    projection_angle_min_(0), projection_angle_increment_(0), projection_beams_(0) {}
+
+  inline void setMaxKeyframes(size_t max_keyframes) { max_keyframes_ = max_keyframes; }
+  inline size_t getMaxKeyframes() const { return max_keyframes_; }
+  inline void setComputeNormals(bool compute_normals) { compute_normals_ = compute_normals; }
+  /// Beams of the sensor: the target is projected into the beams of the newest keyframe. 0 beams: no projection
+  inline void setProjection(float angle_min, float angle_increment, size_t beams) {
+    projection_angle_min_ = angle_min;
+    projection_angle_increment_ = angle_increment;
+    projection_beams_ = beams;
+  }
+
+  /// Number of keyframes in the submap
+  inline size_t size() const { return entries_.size(); }
+  inline bool empty() const { return entries_.empty(); }
+  /// ID of the newest keyframe, -1 if empty
+  inline int last_id() const { return entries_.empty() ? -1 : entries_.back().id; }
+
+  /// Registration target over all the points of the submap, in the world frame
+  inline Target2D::ConstPtr target() const { return target_; }
+
+  bool contains(int id) const {
+    for (size_t i = 0; i < entries_.size(); i++)
+      if (entries_[i].id == id)
+        return true;
+    return false;
+  }
+
+  /**
+   * \brief Append the points of a keyframe, given in its own frame, at pose (x, y, th).
+   *
+   * Rebuilds the registration target, projected from this keyframe if a projection is set.
+   */
+  void add(int id, const PointCloud2D& points, double x, double y, double th) {
+    const float c = cos(th), s = sin(th);
+    const float tx = x, ty = y;
+
+    Entry entry;
+    entry.id = id;
+    entry.count = points.size();
+    entries_.push_back(entry);
+
+    cloud_.reserve(cloud_.size() + points.size());
+    for (size_t i = 0; i < points.size(); i++)
+      cloud_.push_back(tx + c * points.x[i] - s * points.y[i],
+                       ty + s * points.x[i] + c * points.y[i]);
+
+    // drop the oldest keyframes: their points are at the front of the cloud
+    size_t dropped = 0;
+    while (entries_.size() > std::max<size_t>(max_keyframes_, 1)) {
+      dropped += entries_.front().count;
+      entries_.pop_front();
+    }
+    if (dropped > 0) {
+      cloud_.x.erase(cloud_.x.begin(), cloud_.x.begin() + dropped);
+      cloud_.y.erase(cloud_.y.begin(), cloud_.y.begin() + dropped);
+    }
+
+    Target2D::Ptr target(new Target2D(cloud_, compute_normals_));
+    if (projection_beams_ > 0)
+      target->set_projection(x, y, th, projection_angle_min_, projection_angle_increment_, projection_beams_);
+    target_ = target;
+  }
+
+  void clear() {
+    entries_.clear();
+    cloud_.clear();
+    target_.reset();
+  }
+
+private:
+  struct Entry {
+    int id;
+    size_t count; // number of points of this keyframe in cloud_
+  };
+
+  size_t max_keyframes_;
+  bool compute_normals_;
+  float projection_angle_min_, projection_angle_increment_;
+  size_t projection_beams_;
+  std::deque<Entry> entries_; // oldest first, same order as their points in cloud_
+  PointCloud2D cloud_;
+  Target2D::ConstPtr target_;
+};
+
+}
+
+#endif
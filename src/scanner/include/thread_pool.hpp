@@ -0,0 +1,88 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <deque>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace scanner {
+
+/**
+ * \brief Fixed-size pool of worker threads.
+ *
+ * Tasks are scheduled with `schedule()`; `wait()` blocks until every task
+ * scheduled so far has finished. Tasks report their results through state
+ * they own, e.g. one output slot per task.
+ */
+class ThreadPool : private boost::noncopyable {
+public:
+  explicit ThreadPool(size_t threads) : pending_(0), stop_(false) {
+    if (threads == 0)
+      threads = 1;
+    for (size_t i = 0; i < threads; i++)
+      workers_.create_thread(boost::bind(&ThreadPool::run, this));
+  }
+
+  ~ThreadPool() {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stop_ = true;
+    }
+    task_condition_.notify_all();
+    workers_.join_all();
+  }
+
+  inline size_t size() const { return workers_.size(); }
+
+  void schedule(const boost::function<void()>& task) {
+    boost::mutex::scoped_lock lock(mutex_);
+    tasks_.push_back(task);
+    pending_++;
+    task_condition_.notify_one();
+  }
+
+  void wait() {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (pending_ > 0)
+      done_condition_.wait(lock);
+  }
+
+private:
+  void run() {
+    for (;;) {
+      boost::function<void()> task;
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        while (tasks_.empty() && !stop_)
+          task_condition_.wait(lock);
+        if (tasks_.empty())
+          return; // stopped
+        task = tasks_.front();
+        tasks_.pop_front();
+      }
+
+      task();
+
+      boost::mutex::scoped_lock lock(mutex_);
+      if (--pending_ == 0)
+        done_condition_.notify_all();
+    }
+  }
+
+  boost::thread_group workers_;
+  std::deque<boost::function<void()> > tasks_;
+  size_t pending_;
+  bool stop_;
+  boost::mutex mutex_;
+  boost::condition_variable task_condition_;
+  boost::condition_variable done_condition_;
+};
+
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef VOXEL_FILTER2D_HPP
+#define VOXEL_FILTER2D_HPP
+
+#include <cmath>
+
+#include <boost/cstdint.hpp>
+#include <boost/unordered_set.hpp>
+
+#include "icp2d.hpp"
+
+namespace scanner {
+
+/**
+ * \brief Planar voxel-grid downsampling with a point budget.
+ *
+ * Keeps the first point falling in each square cell of side `leaf_size`, so
+ * dense areas (close range, walls seen at normal incidence) are thinned out while
+ * isolated points are all kept. If the result is still over `max_points`, the
+ * cells are grown until it fits.
+ *
+ * A leaf size of 0 and a budget of 0 disable the filter.
+ */
+class VoxelFilter2D {
+public:
+  VoxelFilter2D() : leaf_size_(0), max_points_(0), last_leaf_size_(0) {}
+
+  inline void setLeafSize(double leaf_size) { leaf_size_ = leaf_size; }
+  inline double getLeafSize() const { return leaf_size_; }
+  inline void setMaxPoints(size_t max_points) { max_points_ = max_points; }
+  inline size_t getMaxPoints() const { return max_points_; }
+
+  /// Leaf size actually used by the last call to filter()
+  inline double getLastLeafSize() const { return last_leaf_size_; }
+
+  void filter(const PointCloud2D& input, PointCloud2D& output) {
+    double leaf_size = leaf_size_;
+    const bool over_budget = max_points_ > 0 && input.size() > max_points_;
+
+    if (leaf_size <= 0 && !over_budget) {
+      output = input;
+      last_leaf_size_ = 0;
+      return;
+    }
+    if (leaf_size <= 0)
+      leaf_size = 0.02; // only the budget is set: start from a fine grid
+
+    for (int attempt = 0; attempt < 16; attempt++) {
+      grid(input, output, leaf_size);
+      if (max_points_ == 0 || output.size() <= max_points_)
+        break;
+      leaf_size *= 1.5;
+    }
+    last_leaf_size_ = leaf_size;
+
+    // never exceed the budget, whatever the grid gave
+    if (max_points_ > 0 && output.size() > max_points_) {
+      const double stride = double(output.size()) / max_points_;
+      for (size_t i = 0; i < max_points_; i++) {
+        const size_t k = size_t(i * stride);
+        output.x[i] = output.x[k];
+        output.y[i] = output.y[k];
+      }
+      output.resize(max_points_);
+    }
+  }
+
+private:
+  void grid(const PointCloud2D& input, PointCloud2D& output, double leaf_size) {
+    const double inverse_leaf_size = 1.0 / leaf_size;
+    occupied_.clear();
+    output.clear();
+    output.reserve(input.size());
+    for (size_t i = 0; i < input.size(); i++) {
+      const boost::int32_t cx = boost::int32_t(std::floor(input.x[i] * inverse_leaf_size));
+      const boost::int32_t cy = boost::int32_t(std::floor(input.y[i] * inverse_leaf_size));
+      const boost::uint64_t key = (boost::uint64_t(boost::uint32_t(cx)) << 32) | boost::uint32_t(cy);
+      if (occupied_.insert(key).second)
+        output.push_back(input.x[i], input.y[i]);
+    }
+  }
+
+  double leaf_size_;
+  size_t max_points_;
+  double last_leaf_size_;
+  boost::unordered_set<boost::uint64_t> occupied_; // reused across calls
+};
+
+}
+
+#endif
@@ -1,14 +1,55 @@
 #include "utils.hpp"
 #include "scanner.hpp"
+#include "scanner_node.hpp"
+#include "thread_pool.hpp"
+#include "submap2d.hpp"
+#include "odometry_cache.hpp"
 #include <iostream>
+#include <algorithm>
+#include <deque>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace {
 
 // #### TUNING CONSTANTS START
 // Thresholds for voting for keyframe:
 int gicp_maximum_iterations;
 double gicp_maximum_correspondence_distance, gicp_transformation_epsilon, gicp_euclidean_fitness_epsilon;
+bool gicp_point_to_line;
+
+// Correspondence gates at full resolution
+double tracking_correspondence_distance, loop_correspondence_distance;
+
+// Projective (beam-index) correspondences for tracking, searched within a window of beams
+bool tracking_projective;
+int projective_window;
+
+// Approximate KD-tree search for tracking: epsilon of the first iterations, halved at each one (0: exact)
+double tracking_search_epsilon;
+bool tracking_search_savings; // debug: measure the node visits saved by the approximate search
+
+// Coarse-to-fine pyramid (1 level: full resolution only). Each coarser level keeps
+// one point in `pyramid_stride` of the next one, with a gate `pyramid_gate_factor` wider
+int pyramid_levels, pyramid_stride;
+double pyramid_gate_factor;
 
-int loop_closure_skip;
+// Downsampling ahead of registration
+double filter_leaf_size;
+int filter_max_points;
+
+// Tracking against the last keyframes (1: last keyframe only)
+int submap_keyframes;
+
+// Registration prior from the odometry motion since the last keyframe
+bool use_odometry_prior;
+
+int loop_closure_skip, loop_closure_candidates, loop_closure_threads;
+double loop_closure_max_distance; // candidates further from the last keyframe are not tested (0: no limit)
 double fitness_keyframe_threshold, fitness_loop_threshold, distance_threshold, rotation_threshold;
+double inlier_keyframe_threshold, inlier_loop_threshold;
 
 // Uncertainty model constants
 double k_disp_disp, k_rot_disp, k_rot_rot;
@@ -19,47 +60,153 @@ double sigma_xy, sigma_th;
 ros::Publisher registration_pub;
 ros::Publisher pointcloud_debug_pub;
 ros::Publisher delta_pub;
+ros::Subscriber scanner_sub;
+ros::Subscriber odometry_sub;
+ros::Subscriber keyframe_last_sub;
 ros::ServiceClient keyframe_last_client;
 ros::ServiceClient keyframe_closest_client;
+ros::ServiceClient odometry_buffer_client;
 
-// GICP algorithm
+// ICP algorithm: planar (x, y, theta) registration
 //pcl::GeneralizedIterativeClosestPoint<pcl::PointXYZ, pcl::PointXYZ> gicp;
-pcl::IterativeClosestPoint<pcl::PointXYZ, pcl::PointXYZ> gicp;
+//pcl::IterativeClosestPoint<pcl::PointXYZ, pcl::PointXYZ> gicp;
+scanner::ICP2D gicp;
 
 Eigen::Matrix4f carry_transform; // The transform of the last align which is passed to the next align as initial guess
+OdometryCache odometry_cache; // local copy of the odometry stream, for priors without a service call
 unsigned int loop_closure_skip_count;
 
+// Point buffers, reused from scan to scan: all valid points, and those kept by the filter
+scanner::PointCloud2D scan_points_raw, scan_points;
+scanner::VoxelFilter2D scan_filter;
+
+/**
+ * \brief Loop closure job: the keyframe to close a loop from, and its registration target
+ */
+struct LoopClosureJob {
+    common::Keyframe keyframe_last;
+    scanner::Target2D::ConstPtr target_last;
+};
+
+// Loop closure worker: own job queue, and one ICP instance, filter and point buffers per candidate,
+// so scanner_callback never waits on loop alignment and candidates are registered concurrently
+std::vector<scanner::ICP2D> gicp_loop;
+std::vector<scanner::VoxelFilter2D> loop_filters;
+std::vector<scanner::PointCloud2D> loop_points_raw, loop_points;
+boost::scoped_ptr<scanner::ThreadPool> loop_closure_pool;
+std::deque<LoopClosureJob> loop_closure_jobs;
+boost::mutex loop_closure_mutex; // guards loop_closure_jobs, loop_closure_skip_count and loop_closure_running
+boost::condition_variable loop_closure_condition;
+const size_t loop_closure_jobs_max = 2; // older jobs are dropped beyond this
+bool loop_closure_running = false; // cleared to stop the worker
+boost::scoped_ptr<boost::thread> loop_closure_thread;
+
+// Local copy of the graph's last keyframe, kept current by its update topic (version 0: none received)
+common::Keyframe keyframe_last;
+unsigned int keyframe_last_version = 0;
+unsigned int keyframe_last_solve_version = 0;
+
+// Registration target (points and search index) of the last keyframe, rebuilt only when the keyframe
+// or its version changes
+scanner::Target2D::ConstPtr keyframe_last_target;
+int keyframe_last_target_id;
+unsigned int keyframe_last_target_version;
+
+// Tracking submap: the last keyframes' points in the world frame. Restarted each time the
+// graph commits optimized poses, since the keyframe poses it was built from have moved
+scanner::Submap2D submap;
+unsigned int submap_solve_version = 0;
+
 // Helper functions
 
 using namespace scanner;
 
 /**
- * \brief Align two pointclouds, with transform prior.
+ * \brief Registration target of the last keyframe, at version `version` of the graph's updates.
+ *
+ * The target is cached by keyframe ID and version: its points and search index are
+ * only rebuilt when the graph reports a new or updated last keyframe.
+ */
+Target2D::ConstPtr keyframe_target(const common::Keyframe& keyframe, unsigned int version){
+
+    if (!keyframe_last_target || keyframe.id != keyframe_last_target_id || version != keyframe_last_target_version)
+    {
+        PointCloud2D points_raw, points;
+        scan_to_points(keyframe.scan, scan_filter, points_raw, points);
+        Target2D::Ptr target(new Target2D(points, gicp_point_to_line)); // line normals computed once per keyframe
+        if (tracking_projective)
+            target->set_projection(0, 0, 0, keyframe.scan.angle_min, keyframe.scan.angle_increment, keyframe.scan.ranges.size());
+        keyframe_last_target = target;
+        keyframe_last_target_id = keyframe.id;
+        keyframe_last_target_version = version;
+    }
+
+    return keyframe_last_target;
+}
+
+/**
+ * \brief Registration target for tracking: the submap, or the last keyframe alone.
+ *
+ * The submap target is in the world frame, the keyframe one in the keyframe frame.
+ * The submap is extended when the graph reports a new last keyframe, and restarted
+ * from it when the graph reports optimized poses (`solve_version`): the last keyframe
+ * pose and the submap points then stay in the same frame, and no correction leaks
+ * into the tracking deltas.
+ */
+Target2D::ConstPtr tracking_target(const common::Keyframe& keyframe, unsigned int solve_version,
+                                   const Target2D::ConstPtr& target_keyframe){
+
+    if (submap_keyframes <= 1)
+        return target_keyframe;
+
+    if (solve_version != submap_solve_version)
+    {
+        submap.clear();
+        submap_solve_version = solve_version;
+    }
+
+    if (submap.last_id() != keyframe.id)
+    {
+        if (tracking_projective)
+            submap.setProjection(keyframe.scan.angle_min, keyframe.scan.angle_increment, keyframe.scan.ranges.size());
+        submap.add(keyframe.id, target_keyframe->cloud(),
+                   keyframe.pose_opti.pose.x, keyframe.pose_opti.pose.y, keyframe.pose_opti.pose.theta);
+        ROS_DEBUG("RG: submap: %lu keyframes, %lu points", submap.size(), submap.target()->size());
+    }
+
+    return submap.target();
+}
+
+/**
+ * \brief Align a point cloud to a registration target with a given ICP instance, with transform prior.
+ *
+ * `transform` is relative to a keyframe whose pose in the target frame is `T_target`: the
+ * prior is moved to the target frame for alignment, and the result back to the keyframe.
  *
  * Format the results in a compact structure `Alignement`
  */
-Alignement gicp_register(const sensor_msgs::PointCloud2 input_1, const sensor_msgs::PointCloud2 input_2, Eigen::Matrix4f& transform){
+Alignement gicp_register(ICP2D& icp, const PointCloud2D& input_1, const Target2D::ConstPtr& target,
+                         const Eigen::Matrix4f& T_target, Eigen::Matrix4f& transform){
 
     // assign inputs
-    pcl::PointCloud<pcl::PointXYZ>::Ptr pointcloud_1 = format_pointcloud(input_1);
-    pcl::PointCloud<pcl::PointXYZ>::Ptr pointcloud_2 = format_pointcloud(input_2);
-    gicp.setInputSource(pointcloud_1);
-    gicp.setInputTarget(pointcloud_2);
+    icp.setInputSource(input_1);
+    icp.setInputTarget(target);
 
     // align
-    pcl::PointCloud<pcl::PointXYZ>::Ptr pointcloud_transform(new pcl::PointCloud<pcl::PointXYZ>);
-    gicp.align(*pointcloud_transform, transform);
+    icp.align(matrix4_to_se2(T_target * transform));
 
     Alignement output;
-    output.convergence_state = gicp.getConvergeCriteria()->getConvergenceState();
-    output.converged = gicp.hasConverged();
-    output.fitness = gicp.getFitnessScore();
+    output.convergence_state = static_cast<pcl::registration::DefaultConvergenceCriteria<float>::ConvergenceState>(icp.getConvergenceState());
+    output.converged = icp.hasConverged();
+    output.fitness = icp.getFitnessScore(); // from the last iteration's correspondences: no extra search
+    output.inlier_ratio = icp.getInlierRatio();
+    output.rmse = sqrt(icp.getCorrespondencesMSE());
 
 //    ROS_INFO("Alignement converged: (%d) with fitness: %f", output.converged, output.fitness);
 
-    if (gicp.hasConverged())
+    if (icp.hasConverged())
     {
-        transform = gicp.getFinalTransformation();
+        transform = T_target.inverse() * se2_to_matrix4(icp.getFinalTransformation());
 
         // Get transformation Delta and compute its covariance
         output.transform = transform;
@@ -72,23 +219,104 @@ Alignement gicp_register(const sensor_msgs::PointCloud2 input_1, const sensor_ms
 }
 
 /**
- * \brief Align two pointclouds, without transform prior.
+ * \brief Align a point cloud to a registration target with a given ICP instance, with transform prior.
+ *
+ * Format the results in a compact structure `Alignement`
+ */
+Alignement gicp_register(ICP2D& icp, const PointCloud2D& input_1, const Target2D::ConstPtr& target, Eigen::Matrix4f& transform){
+    return gicp_register(icp, input_1, target, Eigen::Matrix4f::Identity(), transform);
+}
+
+/**
+ * \brief Align a point cloud to a registration target, with transform prior.
+ *
+ * Format the results in a compact structure `Alignement`
+ */
+Alignement gicp_register(const PointCloud2D& input_1, const Target2D::ConstPtr& target, Eigen::Matrix4f& transform){
+    return gicp_register(gicp, input_1, target, transform);
+}
+
+/**
+ * \brief Align a point cloud to a registration target, without transform prior.
  *
  * Format the results in a compact structure `Alignement`
  */
-Alignement gicp_register(const sensor_msgs::PointCloud2 input_1, const sensor_msgs::PointCloud2 input_2){
+Alignement gicp_register(const PointCloud2D& input_1, const Target2D::ConstPtr& target){
     Eigen::Matrix4f guess_null(Eigen::Matrix4f::Identity());
-    return gicp_register(input_1, input_2, guess_null);
+    return gicp_register(input_1, target, guess_null);
+}
+
+
+
+/**
+ * \brief Pyramid levels above full resolution, coarsest first, for a given full-resolution gate
+ */
+std::vector<PyramidLevel2D> make_pyramid(double correspondence_distance)
+{
+    std::vector<PyramidLevel2D> levels;
+    for (int l = pyramid_levels - 1; l > 0; l--)
+        levels.push_back(PyramidLevel2D(size_t(pow(double(pyramid_stride), l)),
+                                        correspondence_distance * pow(pyramid_gate_factor, l),
+                                        gicp_maximum_iterations));
+    return levels;
 }
 
+/**
+ * \brief Create a human-readable text for the iterations and times of each pyramid level
+ */
+std::string pyramid_text(const ICP2D& icp)
+{
+    std::ostringstream text;
+    text << "iterations (time) per level:";
+    for (size_t l = 0; l < icp.getLevelIterations().size(); l++)
+        text << " " << icp.getLevelIterations()[l] << " (" << icp.getLevelTimes()[l] << ")";
+    return text.str();
+}
+
+/**
+ * \brief Odometry motion from the last keyframe to the scan, as a registration prior.
+ *
+ * Served from the local odometry cache; the odometry node's buffer is only
+ * queried while the cache is empty, i.e. no odometry message was received: it holds
+ * the same samples, so it cannot serve what the cache misses.
+ */
+bool odometry_prior(const ros::Time& t_keyframe, const ros::Time& t_scan, Eigen::Matrix4f& transform)
+{
+    geometry_msgs::Pose2D pose_keyframe, pose_scan, delta;
+
+    if (odometry_cache.poses_between(t_keyframe, t_scan, pose_keyframe, pose_scan))
+    {
+        delta = between(pose_keyframe, pose_scan);
+    }
+    else if (odometry_cache.empty())
+    {
+        common::OdometryBuffer odometry_request;
+        odometry_request.request.t_start = t_keyframe;
+        odometry_request.request.t_end = t_scan;
+        if (!odometry_buffer_client.call(odometry_request))
+            return false;
+        delta = odometry_request.response.delta.pose;
+    }
+    else
+        return false;
 
+    transform = make_transform(delta);
+    return true;
+}
 
 /**
  * \brief Policy for creating keyframes
+ *
+ * Never from a failed alignment: it has no Delta (zero pose and covariance), and the
+ * motion factor made from it would be a hard constraint in the graph.
  */
-bool vote_for_keyframe(const common::Pose2DWithCovariance Delta, const double fitness)
+bool vote_for_keyframe(const common::Pose2DWithCovariance& Delta, const Alignement& alignement)
 {
-    if (fitness > fitness_keyframe_threshold) // fitness
+    if (!alignement.converged)
+        return false;
+    if (alignement.fitness > fitness_keyframe_threshold) // fitness
+        return true;
+    if (alignement.inlier_ratio < inlier_keyframe_threshold) // overlap
         return true;
     if (fabs(Delta.pose.theta) > rotation_threshold) // rotation
         return true;
@@ -99,8 +327,163 @@ bool vote_for_keyframe(const common::Pose2DWithCovariance Delta, const double fi
 }
 
 
+/**
+ * \brief Register one loop closure candidate against the last keyframe's target.
+ *
+ * Runs in the loop closure thread pool, using the ICP instance and point buffer of slot `i`.
+ */
+void loop_closure_candidate(const LoopClosureJob& job, const common::Keyframe& keyframe_candidate,
+                            size_t i, Alignement& alignement)
+{
+    // compute prior transform between the 2 keyframes
+    Eigen::Matrix4f T_last = make_transform(job.keyframe_last.pose_opti.pose);
+    Eigen::Matrix4f T_loop = make_transform(keyframe_candidate.pose_opti.pose);
+    Eigen::Matrix4f loop_transform = T_last.inverse()*T_loop;
+
+    // get points
+    scan_to_points(keyframe_candidate.scan, loop_filters[i], loop_points_raw[i], loop_points[i]);
+
+    // Do align
+    double start = ros::Time::now().toSec();
+    alignement = gicp_register(gicp_loop[i], loop_points[i], job.target_last, loop_transform);
+    double end = ros::Time::now().toSec();
+
+    // print some stuff
+    ROS_INFO("LC: candidate %d align time: %f; fitness: %f; inliers: %f; rmse: %f", keyframe_candidate.id, end - start,
+             alignement.fitness, alignement.inlier_ratio, alignement.rmse);
+    ROS_INFO_STREAM("LC: candidate " << keyframe_candidate.id << " " << pyramid_text(gicp_loop[i]));
+    ROS_INFO_STREAM("LC: candidate " << keyframe_candidate.id << " convergence state: " << convergence_text(alignement.convergence_state));
+}
+
+/**
+ * \brief Test a loop closure from one keyframe against its closest keyframes in the graph.
+ *
+ * Runs in the loop closure worker. The candidates are registered concurrently, and the
+ * one with the best fitness under `fitness_loop_threshold`, and with at least `inlier_loop_threshold`
+ * of its points matched, is accepted. Accepted loops are
+ * published on their own, as a `Registration` message with only the loop closure flag set.
+ */
+void loop_closure(const LoopClosureJob& job)
+{
+    // request closest KFs to test for loop closure
+    common::ClosestKeyframe keyframe_closest_request;
+    keyframe_closest_request.request.keyframe_last = job.keyframe_last;
+    keyframe_closest_request.request.candidates = loop_closure_candidates;
+    keyframe_closest_request.request.max_distance = loop_closure_max_distance;
+    bool keyframe_closest_request_returned = keyframe_closest_client.call(keyframe_closest_request);
+
+    if (!keyframe_closest_request_returned)
+        return;
+
+    const std::vector<common::Keyframe>& candidates = keyframe_closest_request.response.keyframes_closest;
+    const size_t n = std::min(candidates.size(), gicp_loop.size());
+
+    // register all candidates
+    std::vector<Alignement> alignements(n);
+    for (size_t i = 0; i < n; i++)
+        loop_closure_pool->schedule(boost::bind(loop_closure_candidate, boost::cref(job), boost::cref(candidates[i]),
+                                                i, boost::ref(alignements[i])));
+    loop_closure_pool->wait();
+
+    // pick the best one
+    int best = -1;
+    for (size_t i = 0; i < n; i++)
+        if (alignements[i].converged && alignements[i].fitness < fitness_loop_threshold &&
+            alignements[i].inlier_ratio >= inlier_loop_threshold &&
+            (best < 0 || alignements[i].fitness < alignements[best].fitness))
+            best = i;
+
+    if (best < 0)
+        return;
+
+    const common::Keyframe& keyframe_closest = candidates[best];
+    const Alignement& alignement_loop = alignements[best];
+    ROS_INFO("LC: accepted candidate %d of %lu; fitness: %f", keyframe_closest.id, n, alignement_loop.fitness);
+    ROS_INFO("LC: Delta: %f %f %f", alignement_loop.Delta.pose.x, alignement_loop.Delta.pose.y, alignement_loop.Delta.pose.theta);
+
+    {
+        boost::mutex::scoped_lock lock(loop_closure_mutex);
+        loop_closure_skip_count = 0;
+    }
+
+    // compose output message
+    common::RegistrationPtr output(new common::Registration);
+    output->first_frame_flag     = false;
+    output->keyframe_flag        = false;
+    output->loop_closure_flag    = true;
+    output->keyframe_last_id     = job.keyframe_last.id; // the graph has the keyframes: refer to them by ID
+    output->keyframe_loop_id     = keyframe_closest.id;
+    output->factor_loop.id_1     = job.keyframe_last.id;
+    output->factor_loop.id_2     = keyframe_closest.id;
+    output->factor_loop.delta    = alignement_loop.Delta;
+
+    registration_pub.publish(output);
+}
+
+/**
+ * \brief Loop closure worker thread: processes loop closure jobs as they are queued.
+ */
+void loop_closure_worker()
+{
+    while (ros::ok())
+    {
+        LoopClosureJob job;
+        {
+            boost::mutex::scoped_lock lock(loop_closure_mutex);
+            while (loop_closure_jobs.empty() && loop_closure_running && ros::ok())
+                loop_closure_condition.timed_wait(lock, boost::posix_time::milliseconds(100));
+            if (loop_closure_jobs.empty() || !loop_closure_running)
+                break;
+            job = loop_closure_jobs.front();
+            loop_closure_jobs.pop_front();
+        }
+
+        loop_closure(job);
+    }
+}
+
 // Node functions
 
+/**
+ * \brief Callback at the reception of an odometry pose: keep it in the local cache
+ */
+void odometry_callback(const common::Odometry& input)
+{
+    odometry_cache.add(input);
+}
+
+/**
+ * \brief Callback at the reception of a last keyframe update from the graph: keep a local copy
+ *
+ * A lower version, or the same one for another keyframe, comes from a restarted graph:
+ * its keyframe IDs start over, so whatever was built from the old ones is dropped.
+ * A graph starts by publishing version 0, without keyframe: the scanner then asks
+ * the graph's service again, and starts it over with a first frame.
+ */
+void keyframe_last_callback(const common::KeyframeUpdate& input)
+{
+    const bool duplicate = input.version == keyframe_last_version &&
+                           input.keyframe.id == keyframe_last.id && input.keyframe.ts == keyframe_last.ts;
+    if (duplicate)
+        return;
+
+    if (keyframe_last_version > 0 && input.version <= keyframe_last_version)
+    {
+        ROS_WARN("RG: graph restarted (last keyframe version %u after %u), resetting tracking",
+                 input.version, keyframe_last_version);
+        keyframe_last_target.reset();
+        submap.clear();
+        boost::mutex::scoped_lock lock(loop_closure_mutex);
+        loop_closure_jobs.clear();
+        loop_closure_skip_count = 0;
+    }
+
+    keyframe_last = input.keyframe;
+    keyframe_last_version = input.version;
+    keyframe_last_solve_version = input.solve_version;
+    ROS_DEBUG("RG: last keyframe %d (version %u)", keyframe_last.id, keyframe_last_version);
+}
+
 /**
  * \brief Callback at the reception of a laser scan
  *
@@ -109,109 +492,109 @@ bool vote_for_keyframe(const common::Pose2DWithCovariance Delta, const double fi
  *   - A new keyframe is to be created
  *   - A loop closure is to be searched and created
  *
- * It publishes all the results in a unique `Registration` message.
+ * It publishes all the results in a unique `Registration` message. Loop closures
+ * are searched in a background worker, which publishes its own messages.
  */
 void scanner_callback(const sensor_msgs::LaserScan& input)
 {
 
     // message to publish -- empty
-    common::Registration output;
+    common::RegistrationPtr output(new common::Registration);
 
     // clear flags:
-    output.first_frame_flag     = false;
-    output.keyframe_flag        = false;
-    output.loop_closure_flag    = false;
-
-    // request last KF
-    common::LastKeyframe keyframe_last_request;
-    bool keyframe_last_request_returned = keyframe_last_client.call(keyframe_last_request);
+    output->first_frame_flag     = false;
+    output->keyframe_flag        = false;
+    output->loop_closure_flag    = false;
+
+    // last KF: the local copy, or the graph's service until the first update arrives,
+    // and while no graph publishes updates (stopped, or not started yet)
+    bool keyframe_last_available = keyframe_last_version > 0 && keyframe_last_sub.getNumPublishers() > 0;
+    if (!keyframe_last_available)
+    {
+        common::LastKeyframe keyframe_last_request;
+        keyframe_last_available = keyframe_last_client.call(keyframe_last_request);
+        if (keyframe_last_available)
+            keyframe_last = keyframe_last_request.response.keyframe_last;
+    }
 
     // Case of first frame
-    if (!keyframe_last_request_returned)
+    if (!keyframe_last_available)
     {
         ROS_INFO("### NO LAST KEYFRAME FOUND : ASSUME FIRST KEYFRAME ###");
 
-        // Set flags, assign pointcloud
-        output.first_frame_flag         = true;
-        output.keyframe_new.scan        = input;
-        output.keyframe_new.pointcloud  = scan_to_pointcloud(input);
+        // Set flags, assign scan
+        output->first_frame_flag         = true;
+        output->keyframe_new.scan        = input;
     }
 
     // Case of other frames
-    if (keyframe_last_request_returned)
+    if (keyframe_last_available)
     {
-        // gather pointclouds
-        sensor_msgs::PointCloud2 input_pointcloud = scan_to_pointcloud(input);
-        sensor_msgs::PointCloud2 keyframe_last_pointcloud = keyframe_last_request.response.keyframe_last.pointcloud;
+        // gather points
+        scan_to_points(input, scan_filter, scan_points_raw, scan_points);
+        ROS_DEBUG("RG: points: %lu -> %lu", scan_points_raw.size(), scan_points.size());
+        Target2D::ConstPtr target_last = keyframe_target(keyframe_last, keyframe_last_version);
+        Target2D::ConstPtr target_tracking = tracking_target(keyframe_last, keyframe_last_solve_version, target_last);
+
+        // the submap lives in the world frame, where the last keyframe sits at its optimized pose
+        Eigen::Matrix4f T_tracking(Eigen::Matrix4f::Identity());
+        if (target_tracking != target_last)
+            T_tracking = make_transform(keyframe_last.pose_opti.pose);
+
+        // prior: odometry since the last keyframe, or else the last alignment
+        if (use_odometry_prior && !odometry_prior(keyframe_last.ts, input.header.stamp, carry_transform))
+            ROS_DEBUG("RG: no odometry between keyframe %d and scan, using the last alignment as prior",
+                      keyframe_last.id);
 
         // Do align
         double start = ros::Time::now().toSec();
-        gicp.setMaxCorrespondenceDistance(0.5); // fine for close range
-        Alignement alignement_last = gicp_register(input_pointcloud, keyframe_last_pointcloud, carry_transform);
+        Alignement alignement_last = gicp_register(gicp, scan_points, target_tracking, T_tracking, carry_transform);
         double end = ros::Time::now().toSec();
+        if (!alignement_last.converged)
+            ROS_WARN_STREAM("RG: alignment to keyframe " << keyframe_last.id << " failed, no keyframe: "
+                            << convergence_text(alignement_last.convergence_state));
 
         // compose output message for KF creation
-        output.keyframe_flag            = vote_for_keyframe(alignement_last.Delta, alignement_last.fitness);
-        output.keyframe_new.ts          = input.header.stamp;
-        output.keyframe_new.pointcloud  = input_pointcloud;
-        output.keyframe_new.scan        = input;
-        output.keyframe_last            = keyframe_last_request.response.keyframe_last;
-        output.factor_new.id_1          = keyframe_last_request.response.keyframe_last.id;
-        output.factor_new.id_2          = output.keyframe_new.id;
-        output.factor_new.delta         = alignement_last.Delta;
+        output->keyframe_flag            = vote_for_keyframe(alignement_last.Delta, alignement_last);
+        output->keyframe_new.ts          = input.header.stamp;
+        output->keyframe_last_id         = keyframe_last.id; // the graph has the keyframe: refer to it by ID
+        output->factor_new.id_1          = keyframe_last.id;
+        output->factor_new.id_2          = output->keyframe_new.id;
+        output->factor_new.delta         = alignement_last.Delta;
 
         // Keyframe creation
-        if (output.keyframe_flag)
+        if (output->keyframe_flag)
         {
-        	ROS_INFO("RG: align time: %f; fitness: %f", end - start, alignement_last.fitness);
+            output->keyframe_new.scan    = input; // sensor data only travels with new keyframes
+        	ROS_INFO("RG: align time: %f; fitness: %f; inliers: %f; rmse: %f", end - start,
+                     alignement_last.fitness, alignement_last.inlier_ratio, alignement_last.rmse);
             ROS_INFO_STREAM("RG: convergence state: " << convergence_text(alignement_last.convergence_state)); //convergence_text(alignement_loop.convergence_state));
             ROS_INFO("RG: Delta: %f %f %f", alignement_last.Delta.pose.x, alignement_last.Delta.pose.y, alignement_last.Delta.pose.theta);
+            ROS_INFO("RG: points: %lu -> %lu (leaf %f)", scan_points_raw.size(), scan_points.size(), scan_filter.getLastLeafSize());
+            ROS_INFO_STREAM("RG: " << pyramid_text(gicp));
+            if (tracking_search_savings)
+                ROS_INFO("RG: KD-tree node visits: %lu (%.0f saved by approximate search)",
+                         gicp.getSearchVisits(), gicp.getSearchVisitsSaved());
+            else
+                ROS_INFO("RG: KD-tree node visits: %lu", gicp.getSearchVisits());
             carry_transform.setIdentity();
 
             // Check for loop closures only if on Keyframes
+            boost::mutex::scoped_lock lock(loop_closure_mutex);
             loop_closure_skip_count++;
             if (loop_closure_skip_count >= loop_closure_skip) // only try once in a while
             {
-
-                // request closest KF to test for loop closure
-                common::ClosestKeyframe keyframe_closest_request;
-                keyframe_closest_request.request.keyframe_last = keyframe_last_request.response.keyframe_last;
-                bool keyframe_closest_request_returned = keyframe_closest_client.call(keyframe_closest_request);
-
-                if (keyframe_closest_request_returned)
+                // hand the loop closure over to the worker
+                LoopClosureJob job;
+                job.keyframe_last = keyframe_last;
+                job.target_last = target_last;
+                loop_closure_jobs.push_back(job);
+                if (loop_closure_jobs.size() > loop_closure_jobs_max)
                 {
-                    // compute prior transform between the 2 keyframes
-                    Eigen::Matrix4f T_last = make_transform(keyframe_last_request.response.keyframe_last.pose_opti.pose);
-                    Eigen::Matrix4f T_loop = make_transform(keyframe_closest_request.response.keyframe_closest.pose_opti.pose);
-                    Eigen::Matrix4f loop_transform = T_last.inverse()*T_loop;
-
-                    // get pointcloud
-                    sensor_msgs::PointCloud2 keyframe_closest_pointcloud =
-                            keyframe_closest_request.response.keyframe_closest.pointcloud;
-
-                    // Do align
-                    start = ros::Time::now().toSec();
-                    gicp.setMaxCorrespondenceDistance(1.0); // coarse for loop closure
-                    Alignement alignement_loop = gicp_register(keyframe_closest_pointcloud, keyframe_last_pointcloud, loop_transform);
-                    end = ros::Time::now().toSec();
-
-                    // print some stuff
-                    ROS_INFO("LC: align time: %f; fitness: %f", end - start, alignement_loop.fitness);
-                    ROS_INFO_STREAM("LC: convergence state: " << convergence_text(alignement_loop.convergence_state));
-                    ROS_INFO("LC: Delta: %f %f %f", alignement_loop.Delta.pose.x, alignement_loop.Delta.pose.y, alignement_loop.Delta.pose.theta);
-
-                    // compose output message
-                    output.loop_closure_flag    = (alignement_loop.converged && alignement_loop.fitness < fitness_loop_threshold);
-                    output.keyframe_last        = keyframe_last_request.response.keyframe_last;
-                    output.keyframe_loop        = keyframe_closest_request.response.keyframe_closest;
-                    output.factor_loop.id_1     = keyframe_last_request.response.keyframe_last.id;
-                    output.factor_loop.id_2     = keyframe_closest_request.response.keyframe_closest.id;
-                    output.factor_loop.delta    = alignement_loop.Delta;
-
-                    if (output.loop_closure_flag)
-                        loop_closure_skip_count = 0;
-
-                } // keyframe closest returned
+                    ROS_WARN("LC: worker busy, dropping loop closure test from keyframe %d", loop_closure_jobs.front().keyframe_last.id);
+                    loop_closure_jobs.pop_front();
+                }
+                loop_closure_condition.notify_one();
             } // loop closure skip count
         } // keyframe_flag
     } // other keyframes
@@ -221,26 +604,28 @@ void scanner_callback(const sensor_msgs::LaserScan& input)
 
 }
 
+} // namespace
+
 /**
- * \brief Main process
+ * \brief Start the scanner
  *
  * Initialize all services, subscribers and publishers.
  *
- * Initialize and setup the ICP alignment algorithm
+ * Initialize and setup the ICP alignment algorithm, and start the loop closure worker.
  */
-int main(int argc, char** argv) {
-  ros::init(argc, argv, "scanner");
-  ros::NodeHandle n;
-
-  ros::Subscriber scanner_sub = n.subscribe("/base_scan", 1, scanner_callback);
+void scanner_start(ros::NodeHandle& n) {
+  scanner_sub = n.subscribe("/base_scan", 1, scanner_callback);
+  odometry_sub = n.subscribe("/odometry/odometry", 100, odometry_callback); // feeds the odometry prior cache
+  keyframe_last_sub = n.subscribe("/graph/last_keyframe_update", 1, keyframe_last_callback);
 
   delta_pub = n.advertise<geometry_msgs::Pose2D>("/scanner/delta", 1);
   
-  registration_pub  = n.advertise<common::Registration>("/scanner/registration", 1);
+  registration_pub  = n.advertise<common::Registration>("/scanner/registration", 10); // loop closures arrive asynchronously: do not drop them
   pointcloud_debug_pub = n.advertise<sensor_msgs::PointCloud2>("/scanner/debug_pointcloud", 1);
 
   keyframe_last_client = n.serviceClient<common::LastKeyframe>("/graph/last_keyframe");
   keyframe_closest_client = n.serviceClient<common::ClosestKeyframe>("/graph/closest_keyframe");
+  odometry_buffer_client = n.serviceClient<common::OdometryBuffer>("/odometry/odometry_buffer");
 
   // Setup ICP algorithm
   gicp.setUseReciprocalCorrespondences(true);
@@ -283,6 +668,107 @@ int main(int argc, char** argv) {
 	     gicp_euclidean_fitness_epsilon);
   }
 
+  // ### rosparam get gicp_point_to_line ###
+  if(ros::param::get("/scanner/gicp_point_to_line", gicp_point_to_line)) {
+    gicp.setPointToLine(gicp_point_to_line);
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/gicp_point_to_line = %d", gicp_point_to_line);
+  } else {
+    gicp_point_to_line = false;
+    gicp.setPointToLine(gicp_point_to_line);
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/gicp_point_to_line = %d", gicp_point_to_line);
+  }
+
+  // ### rosparam get tracking_correspondence_distance ###
+  if(ros::param::get("/scanner/tracking_correspondence_distance", tracking_correspondence_distance)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/tracking_correspondence_distance = %f", tracking_correspondence_distance);
+  } else {
+    tracking_correspondence_distance = 0.5; // fine for close range
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/tracking_correspondence_distance = %f", tracking_correspondence_distance);
+  }
+
+  // ### rosparam get loop_correspondence_distance ###
+  if(ros::param::get("/scanner/loop_correspondence_distance", loop_correspondence_distance)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/loop_correspondence_distance = %f", loop_correspondence_distance);
+  } else {
+    loop_correspondence_distance = 1.0; // coarse for loop closure
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/loop_correspondence_distance = %f", loop_correspondence_distance);
+  }
+
+  // ### rosparam get tracking_projective ###
+  if(ros::param::get("/scanner/tracking_projective", tracking_projective)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/tracking_projective = %d", tracking_projective);
+  } else {
+    tracking_projective = false; // KD-tree search
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/tracking_projective = %d", tracking_projective);
+  }
+
+  // ### rosparam get projective_window ###
+  if(ros::param::get("/scanner/projective_window", projective_window)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/projective_window = %d", projective_window);
+  } else {
+    projective_window = 5; // beams on each side
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/projective_window = %d", projective_window);
+  }
+
+  // ### rosparam get tracking_search_epsilon ###
+  if(ros::param::get("/scanner/tracking_search_epsilon", tracking_search_epsilon)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/tracking_search_epsilon = %f", tracking_search_epsilon);
+  } else {
+    tracking_search_epsilon = 0.0; // exact search
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/tracking_search_epsilon = %f", tracking_search_epsilon);
+  }
+
+  // ### rosparam get tracking_search_savings ###
+  if(ros::param::get("/scanner/tracking_search_savings", tracking_search_savings)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/tracking_search_savings = %d", tracking_search_savings);
+  } else {
+    tracking_search_savings = false; // extra exact searches: debug only
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/tracking_search_savings = %d", tracking_search_savings);
+  }
+
+  // ### rosparam get pyramid_levels ###
+  if(ros::param::get("/scanner/pyramid_levels", pyramid_levels)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/pyramid_levels = %d", pyramid_levels);
+  } else {
+    pyramid_levels = 1; // full resolution only
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/pyramid_levels = %d", pyramid_levels);
+  }
+
+  // ### rosparam get pyramid_stride ###
+  if(ros::param::get("/scanner/pyramid_stride", pyramid_stride)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/pyramid_stride = %d", pyramid_stride);
+  } else {
+    pyramid_stride = 4;
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/pyramid_stride = %d", pyramid_stride);
+  }
+  pyramid_stride = std::max(pyramid_stride, 1);
+
+  // ### rosparam get pyramid_gate_factor ###
+  if(ros::param::get("/scanner/pyramid_gate_factor", pyramid_gate_factor)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/pyramid_gate_factor = %f", pyramid_gate_factor);
+  } else {
+    pyramid_gate_factor = 2.0;
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/pyramid_gate_factor = %f", pyramid_gate_factor);
+  }
+
+  // ### rosparam get filter_leaf_size ###
+  if(ros::param::get("/scanner/filter_leaf_size", filter_leaf_size)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/filter_leaf_size = %f", filter_leaf_size);
+  } else {
+    filter_leaf_size = 0.0; // no downsampling
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/filter_leaf_size = %f", filter_leaf_size);
+  }
+  scan_filter.setLeafSize(filter_leaf_size);
+
+  // ### rosparam get filter_max_points ###
+  if(ros::param::get("/scanner/filter_max_points", filter_max_points)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/filter_max_points = %d", filter_max_points);
+  } else {
+    filter_max_points = 0; // no budget
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/filter_max_points = %d", filter_max_points);
+  }
+  scan_filter.setMaxPoints(std::max(filter_max_points, 0));
+
   // ### rosparam get fitness_keyframe_threshold ###
   if(ros::param::get("/scanner/fitness_keyframe_threshold", fitness_keyframe_threshold)) {
     ROS_INFO("ROSPARAM: [LOADED] /scanner/fitness_keyframe_threshold = %f", fitness_keyframe_threshold);
@@ -300,6 +786,22 @@ int main(int argc, char** argv) {
     ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/fitness_loop_threshold = %f", fitness_loop_threshold);
   }
 
+  // ### rosparam get inlier_keyframe_threshold ###
+  if(ros::param::get("/scanner/inlier_keyframe_threshold", inlier_keyframe_threshold)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/inlier_keyframe_threshold = %f", inlier_keyframe_threshold);
+  } else {
+    inlier_keyframe_threshold = 0.5;
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/inlier_keyframe_threshold = %f", inlier_keyframe_threshold);
+  }
+
+  // ### rosparam get inlier_loop_threshold ###
+  if(ros::param::get("/scanner/inlier_loop_threshold", inlier_loop_threshold)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/inlier_loop_threshold = %f", inlier_loop_threshold);
+  } else {
+    inlier_loop_threshold = 0.3;
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/inlier_loop_threshold = %f", inlier_loop_threshold);
+  }
+
   // ### rosparam get distance_threshold ###
   if(ros::param::get("/scanner/distance_threshold", distance_threshold)) {
     ROS_INFO("ROSPARAM: [LOADED] /scanner/distance_threshold = %f", distance_threshold);
@@ -324,6 +826,48 @@ int main(int argc, char** argv) {
     ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/loop_closure_skip = %d", loop_closure_skip);
   }
 
+  // ### rosparam get submap_keyframes ###
+  if(ros::param::get("/scanner/submap_keyframes", submap_keyframes)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/submap_keyframes = %d", submap_keyframes);
+  } else {
+    submap_keyframes = 1; // last keyframe only
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/submap_keyframes = %d", submap_keyframes);
+  }
+  submap.setMaxKeyframes(std::max(submap_keyframes, 1));
+  submap.setComputeNormals(gicp_point_to_line);
+
+  // ### rosparam get use_odometry_prior ###
+  if(ros::param::get("/scanner/use_odometry_prior", use_odometry_prior)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/use_odometry_prior = %d", use_odometry_prior);
+  } else {
+    use_odometry_prior = false;
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/use_odometry_prior = %d", use_odometry_prior);
+  }
+
+  // ### rosparam get loop_closure_candidates ###
+  if(ros::param::get("/scanner/loop_closure_candidates", loop_closure_candidates)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/loop_closure_candidates = %d", loop_closure_candidates);
+  } else {
+    loop_closure_candidates = 3;
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/loop_closure_candidates = %d", loop_closure_candidates);
+  }
+
+  // ### rosparam get loop_closure_max_distance ###
+  if(ros::param::get("/scanner/loop_closure_max_distance", loop_closure_max_distance)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/loop_closure_max_distance = %f", loop_closure_max_distance);
+  } else {
+    loop_closure_max_distance = 5.0; // [m] keyframes further apart hardly share any scan
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/loop_closure_max_distance = %f", loop_closure_max_distance);
+  }
+
+  // ### rosparam get loop_closure_threads ###
+  if(ros::param::get("/scanner/loop_closure_threads", loop_closure_threads)) {
+    ROS_INFO("ROSPARAM: [LOADED] /scanner/loop_closure_threads = %d", loop_closure_threads);
+  } else {
+    loop_closure_threads = std::min(int(boost::thread::hardware_concurrency()), loop_closure_candidates);
+    ROS_WARN("ROSPARAM: [NOT LOADED][DEFAULT SET] /scanner/loop_closure_threads = %d", loop_closure_threads);
+  }
+
   // ### rosparam get k_disp_disp ###
   if(ros::param::get("/scanner/k_disp_disp", k_disp_disp)) {
     ROS_INFO("ROSPARAM: [LOADED] /scanner/k_disp_disp = %f", k_disp_disp);
@@ -365,27 +909,59 @@ int main(int argc, char** argv) {
   }
 
   // Spy ICP convergence criteria:
-  ROS_INFO("ICP: max iter sim transf: %d", gicp.getConvergeCriteria()->getMaximumIterationsSimilarTransforms());
-  ROS_INFO("ICP: fail after max iter: %d ", gicp.getConvergeCriteria()->getFailureAfterMaximumIterations());
-  ROS_INFO("ICP: abs MSE : %f [x1e8]", 1e8*gicp.getConvergeCriteria()->getAbsoluteMSE());
-  ROS_INFO("ICP: rel MSE : %f ", gicp.getConvergeCriteria()->getRelativeMSE());
-  ROS_INFO("ICP: rot th  : %f [rad]", acos(gicp.getConvergeCriteria()->getRotationThreshold()));
-  ROS_INFO("ICP: trans th: %f [m]", sqrt(gicp.getConvergeCriteria()->getTranslationThreshold()));
-  ROS_INFO("ICP: max iter: %d ", gicp.getConvergeCriteria()->getMaximumIterations());
-  ROS_INFO("ICP: RANSAC iter: %d ", int(gicp.getRANSACIterations()));
-
-  gicp.getConvergeCriteria()->setMaximumIterationsSimilarTransforms(10);
-  ROS_INFO("ICP: max iter sim transf: %d", gicp.getConvergeCriteria()->getMaximumIterationsSimilarTransforms());
-
-  //  gicp.setRANSACIterations(10);
-  //  ROS_INFO("ICP: RANSAC iter: %d ", int(gicp.getRANSACIterations()));
-
-  //  gicp.getConvergeCriteria()->setFailureAfterMaximumIterations(true);
-  //  ROS_INFO("ICP: fail after max iter: %d ", gicp.getConvergeCriteria()->getFailureAfterMaximumIterations());
+  ROS_INFO("ICP: max iter sim transf: %d", gicp.getMaximumIterationsSimilarTransforms());
+  ROS_INFO("ICP: rel MSE : %f ", gicp.getEuclideanFitnessEpsilon());
+  ROS_INFO("ICP: rot th  : %f [rad]", acos(gicp.getRotationEpsilon()));
+  ROS_INFO("ICP: trans th: %f [m]", sqrt(gicp.getTransformationEpsilon()));
+  ROS_INFO("ICP: max iter: %d ", gicp.getMaximumIterations());
+
+  gicp.setMaximumIterationsSimilarTransforms(10);
+  ROS_INFO("ICP: max iter sim transf: %d", gicp.getMaximumIterationsSimilarTransforms());
+
+  // Tracking and loop closure gates, and their pyramids
+  gicp.setMaxCorrespondenceDistance(tracking_correspondence_distance);
+  gicp.setPyramid(make_pyramid(tracking_correspondence_distance));
+  gicp.setCorrespondenceStrategy(tracking_projective ? CORRESPONDENCES_2D_PROJECTIVE : CORRESPONDENCES_2D_KDTREE);
+  gicp.setProjectiveWindow(projective_window);
+  gicp.setSearchEpsilon(tracking_search_epsilon);
+  gicp.setMeasureSearchSavings(tracking_search_savings);
+  ROS_INFO("ICP: pyramid levels: %d", int(gicp.getPyramid().size()) + 1);
 
   carry_transform.setIdentity();
   loop_closure_skip_count = 0;
+  keyframe_last_target_id = 0;
+  keyframe_last_target_version = 0;
+
+  // Loop closure worker and its thread pool, with the same ICP tuning for every candidate (but the gates)
+  ICP2D gicp_loop_setup(gicp);
+  gicp_loop_setup.setMaxCorrespondenceDistance(loop_correspondence_distance);
+  gicp_loop_setup.setPyramid(make_pyramid(loop_correspondence_distance));
+  gicp_loop_setup.setCorrespondenceStrategy(CORRESPONDENCES_2D_KDTREE); // loop motions are too large for beam windows
+  gicp_loop_setup.setSearchEpsilon(0); // loop closures are accepted on the fitness of exact neighbours
+  gicp_loop.assign(std::max(loop_closure_candidates, 1), gicp_loop_setup);
+  loop_filters.assign(gicp_loop.size(), scan_filter);
+  loop_points_raw.resize(gicp_loop.size());
+  loop_points.resize(gicp_loop.size());
+  loop_closure_pool.reset(new ThreadPool(std::max(loop_closure_threads, 1)));
+  loop_closure_running = true;
+  loop_closure_thread.reset(new boost::thread(loop_closure_worker));
+}
 
-  ros::spin();
-  return 0;
+/**
+ * \brief Stop the scanner: unsubscribe, and wait for the loop closure worker to finish its job
+ */
+void scanner_stop() {
+  scanner_sub.shutdown();
+  odometry_sub.shutdown();
+  keyframe_last_sub.shutdown();
+
+  {
+    boost::mutex::scoped_lock lock(loop_closure_mutex);
+    loop_closure_running = false;
+  }
+  loop_closure_condition.notify_all();
+  if (loop_closure_thread)
+    loop_closure_thread->join();
+  loop_closure_thread.reset();
+  loop_closure_pool.reset();
 }
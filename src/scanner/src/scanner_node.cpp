@@ -0,0 +1,15 @@
+#include "scanner_node.hpp"
+
+/**
+ * \brief Main process: the scanner as a standalone node
+ */
+int main(int argc, char** argv) {
+  ros::init(argc, argv, "scanner");
+  ros::NodeHandle n;
+
+  scanner_start(n);
+  ros::spin();
+  scanner_stop();
+
+  return 0;
+}
@@ -0,0 +1,27 @@
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+
+#include "scanner_node.hpp"
+
+namespace scanner {
+
+/**
+ * \brief The scanner as a nodelet.
+ *
+ * Loaded in the same manager as the graph and markers nodelets, registration
+ * messages are passed by pointer instead of being serialized.
+ */
+class ScannerNodelet : public nodelet::Nodelet {
+public:
+  virtual ~ScannerNodelet() { scanner_stop(); }
+
+private:
+  virtual void onInit() {
+    // single-threaded handle: callbacks run one at a time, as in the standalone node
+    scanner_start(getNodeHandle());
+  }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(scanner::ScannerNodelet, nodelet::Nodelet)